@@ -0,0 +1,112 @@
+#include "RvAot.h"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <typeinfo>
+#include <vector>
+
+#include "RvDecodeCache.h"
+#include "RvExcept.hpp"
+
+const RvAotBlock *rv_aot_find(uint64_t pc)
+{
+    auto end{ rv_aot_blocks + rv_aot_block_count };
+    auto it{ std::lower_bound(rv_aot_blocks, end, pc, [](const RvAotBlock &block, uint64_t pc) { return block.start_pc < pc; }) };
+    return it != end && it->start_pc == pc ? it : nullptr;
+}
+
+void rv_aot_syscall(RvAotContext &c, uint64_t next_pc)
+{
+    std::cerr << "Program issued a syscall." << std::endl;
+    for (int i{ 0 }; i < 32; i++) {
+        std::cout << RVREGABINAME[i] << "=0x" << std::hex << c.x[i] << std::endl;
+    }
+    std::cout << "pc=0x" << std::hex << next_pc << std::endl;
+}
+
+uint64_t rv_aot_run(RvMem &mem, RvReg &reg, uint64_t halt_pc)
+{
+    RvAotContext c{ {}, mem, 0, 0, 0 };
+    for (uint8_t i{ 1 }; i < 32; i++)
+        c.x[i] = reg[i];
+    RvDecodeCache icache(mem);
+    // The translation only matches the image as loaded, have writes to it tracked
+    // and keep the generation of each page it covers
+    auto page_gen{ [&](uint64_t page) -> uint64_t {
+        try {
+            return mem.generation(page << 12);
+        }
+        catch (const RvAccVio &) {
+            return ~uint64_t{};
+        }
+    } };
+    std::map<uint64_t, uint64_t> pages;
+    for (size_t i{ 0 }; i < rv_aot_block_count; i++) {
+        auto &block{ rv_aot_blocks[i] };
+        for (auto page{ block.start_pc >> 12 }; page <= (block.start_pc + block.length * 4 - 1) >> 12; page++)
+            pages.emplace(page, page_gen(page));
+    }
+    // Blocks on pages that changed since are interpreted, checked again
+    // whenever anything moves the code generation
+    std::vector<bool> usable(rv_aot_block_count, true);
+    auto gen{ mem.code_generation() };
+    auto revalidate{ [&] {
+        for (size_t i{ 0 }; i < rv_aot_block_count; i++) {
+            auto &block{ rv_aot_blocks[i] };
+            for (auto page{ block.start_pc >> 12 }; usable[i] && page <= (block.start_pc + block.length * 4 - 1) >> 12; page++)
+                usable[i] = page_gen(page) == pages[page];
+        }
+        gen = mem.code_generation();
+    } };
+    uint64_t pc{ reg.pc };
+    const RvAotBlock *block{};
+    try {
+        while (pc != halt_pc) {
+            if (mem.code_generation() != gen)
+                revalidate();
+            block = rv_aot_find(pc);
+            if (block && !usable[block - rv_aot_blocks])
+                block = nullptr;
+            if (block) {
+                c.depth = 0;
+                pc = block->func(c, pc);
+                continue;
+            }
+            // Interpret one inst, like RvSimpleCpu without the trace
+            for (uint8_t i{ 1 }; i < 32; i++)
+                reg[i] = c.x[i];
+            reg.pc = c.pc = pc;
+            auto &inst{ icache.fetch(pc) };
+            auto result{ inst.exec(reg) };
+            if (result.mem_acc)
+                inst.mem(reg, mem, *result.mem_acc);
+            pc = result.next_pc;
+            for (uint8_t i{ 1 }; i < 32; i++)
+                c.x[i] = reg[i];
+            c.count++;
+            if (result.trap == RvExecResult::T_ECALL)
+                rv_aot_syscall(c, pc);
+        }
+        c.pc = pc;
+    }
+    catch (const RvHalt &e) {
+        ;
+    }
+    catch (const RvException &e) {
+        std::cerr << "We encountered an exception " << typeid(e).name() << ", " << e.what() << std::endl;
+        // Blocks were counted whole when entered, the faulting inst and the rest never ran
+        if (block) {
+            auto end{ rv_aot_blocks + rv_aot_block_count };
+            auto it{ std::upper_bound(rv_aot_blocks, end, c.pc, [](uint64_t pc, const RvAotBlock &block) { return pc < block.start_pc; }) };
+            if (it != rv_aot_blocks) {
+                --it;
+                c.count -= (it->start_pc + it->length * 4 - c.pc) >> 2;
+            }
+        }
+    }
+    for (uint8_t i{ 1 }; i < 32; i++)
+        reg[i] = c.x[i];
+    reg.pc = c.pc;
+    return c.count;
+}
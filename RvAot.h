@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "RvCpu.h"
+#include "RvMem.h"
+#include "RvInst.h"
+#include "RvOpTable.hpp"
+
+// Runtime of programs translated ahead of time by RvAotTranslate.
+// The translation has one C++ function per guest function, taking the pc
+// of one of its blocks and returning the pc it leaves for. Jumps within a
+// function are gotos, calls to known functions are host calls, anything
+// else goes back through the block table.
+
+// Guest state shared by translated functions
+struct RvAotContext {
+    uint64_t x[32];
+    RvMem &mem;
+    // Retired insts, a block is added as a whole when it's entered
+    uint64_t count;
+    // Set before each inst that may fault
+    uint64_t pc;
+    // Host calls between translated functions, deeper calls go back to the table
+    uint64_t depth;
+};
+
+using RvAotFunc = uint64_t (*)(RvAotContext &c, uint64_t pc);
+
+struct RvAotBlock {
+    uint64_t start_pc;
+    uint64_t length;
+    RvAotFunc func;
+};
+
+constexpr uint64_t RV_AOT_MAX_DEPTH{ 4096 };
+
+// Provided by the translation, blocks are sorted by start_pc
+extern const uint64_t rv_aot_image_hash;
+extern const RvAotBlock rv_aot_blocks[];
+extern const size_t rv_aot_block_count;
+
+// Translated block starting at pc, nullptr if there's none
+const RvAotBlock *rv_aot_find(uint64_t pc);
+// Report a syscall like RvBaseCpu does
+void rv_aot_syscall(RvAotContext &c, uint64_t next_pc);
+// Run from reg until pc reaches halt_pc, untranslated or modified code is
+// interpreted. Guest faults are reported like RvSimpleCpu does, reg holds
+// the state they left. Returns retired insts
+uint64_t rv_aot_run(RvMem &mem, RvReg &reg, uint64_t halt_pc);
+
+template <RvOp op>
+inline uint64_t rv_r(uint64_t s1, uint64_t s2)
+{
+    constexpr auto fn{ r_entry(op).fn };
+    return fn(s1, s2);
+}
+
+template <RvOp op>
+inline uint64_t rv_i(uint64_t s1, int64_t imm)
+{
+    constexpr auto fn{ i_entry(op).fn };
+    return fn(s1, imm);
+}
+
+template <RvOp op>
+inline bool rv_b(uint64_t s1, uint64_t s2)
+{
+    constexpr auto fn{ sb_entry(op).fn };
+    return fn(s1, s2);
+}
+
+template <typename T>
+inline uint64_t rv_load(RvMem &mem, uint64_t addr)
+{
+    if (addr & (sizeof(T) - 1))
+        throw RvMisAlign(addr);
+    return static_cast<uint64_t>(static_cast<T>(mem[addr]));
+}
+
+template <typename T>
+inline void rv_store(RvMem &mem, uint64_t addr, uint64_t value)
+{
+    if (addr & (sizeof(T) - 1))
+        throw RvMisAlign(addr);
+    mem[addr] = static_cast<T>(value);
+}
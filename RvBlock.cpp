@@ -0,0 +1,224 @@
+#include "RvBlock.h"
+
+static bool ends_block(const RvDecodedInst &inst)
+{
+    switch (inst.op) {
+    case RvOp::JALR:
+    case RvOp::ECALL:
+    case RvOp::JAL:
+    case RvOp::FENCE_I:
+        return true;
+    default:
+        return inst.is_branch() || inst.is_fault();
+    }
+}
+
+// Op fusing first with second, or first.op if they aren't a known pair.
+// Both always run, so every register they write is still written
+static RvOp fused_op(const RvDecodedInst &first, const RvDecodedInst &second)
+{
+    auto rd{ first.rd };
+    if (rd == RvBlockContext::ZERO_SINK)
+        return first.op;
+    // Pairs working on one register
+    bool chained{ second.rs1 == rd && second.rd == rd };
+    switch (first.op) {
+    case RvOp::LUI:
+        return second.op == RvOp::ADDI && chained ? RvBlock::LUI_ADDI : first.op;
+    case RvOp::AUIPC:
+        if (second.op == RvOp::ADDI && chained)
+            return RvBlock::AUIPC_ADDI;
+        return second.op == RvOp::JALR && second.rs1 == rd ? RvBlock::AUIPC_JALR : first.op;
+    case RvOp::SLLI:
+        return second.op == RvOp::SRLI && chained ? RvBlock::SLLI_SRLI : first.op;
+    default:
+        break;
+    }
+    if ((second.op != RvOp::BEQ && second.op != RvOp::BNE) || second.rs1 != rd || second.rs2 != 0)
+        return first.op;
+    switch (first.op) {
+    case RvOp::SLT:
+        return RvBlock::SLT_BRANCH;
+    case RvOp::SLTU:
+        return RvBlock::SLTU_BRANCH;
+    case RvOp::SLTI:
+        return RvBlock::SLTI_BRANCH;
+    default:
+        return first.op;
+    }
+}
+
+RvOp RvBlock::unfused(RvOp op)
+{
+    switch (op) {
+    case LUI_ADDI:
+        return RvOp::LUI;
+    case AUIPC_ADDI:
+    case AUIPC_JALR:
+        return RvOp::AUIPC;
+    case SLLI_SRLI:
+        return RvOp::SLLI;
+    case SLT_BRANCH:
+        return RvOp::SLT;
+    case SLTU_BRANCH:
+        return RvOp::SLTU;
+    case SLTI_BRANCH:
+        return RvOp::SLTI;
+    default:
+        return op;
+    }
+}
+
+RvBlockCache::RvBlockCache(RvMem &mem, std::shared_ptr<RvDecodeCache> icache, const std::set<uint64_t> &breakpoint)
+    : mem{ mem }
+    , icache{ icache }
+    , breakpoint{ breakpoint }
+    , epoch{ mem.code_generation() }
+    , next_id{}
+    , ras{}
+    , ras_top{}
+    , ras_depth{}
+{
+    return;
+}
+
+void RvBlockCache::revalidate()
+{
+    for (auto it{ blocks.begin() }; it != blocks.end();) {
+        auto &block{ *it->second };
+        bool valid{};
+        try {
+            valid = block.gen == mem.generation(block.start_pc);
+        }
+        catch (const RvAccVio &e) {
+            ;
+        }
+        if (!valid) {
+            it = blocks.erase(it);
+            continue;
+        }
+        block.link[0] = block.link[1] = nullptr;
+        block.jalr_pc = RvBlock::NO_LINK;
+        block.jalr_block = nullptr;
+        ++it;
+    }
+    // Callers may be gone
+    ras_depth = 0;
+    epoch = mem.code_generation();
+}
+
+RvBlock *RvBlockCache::find(uint64_t pc)
+{
+    auto it{ blocks.find(pc) };
+    return it == blocks.end() ? nullptr : it->second.get();
+}
+
+RvBlock &RvBlockCache::build(uint64_t pc)
+{
+    auto block{ std::make_unique<RvBlock>() };
+    block->start_pc = pc;
+    block->id = next_id++;
+    block->breakpoint = breakpoint.contains(pc);
+    for (;;) {
+        auto inst{ icache->fetch(pc) };
+        if (inst.rd == 0)
+            inst.rd = RvBlockContext::ZERO_SINK;
+        block->insts.push_back(inst);
+        pc += 4;
+        if (ends_block(inst))
+            break;
+        if ((pc & 0xfff) == 0 || block->insts.size() == RvBlock::MAX_LEN || breakpoint.contains(pc)) {
+            block->insts.push_back({ nullptr, 0, RvBlock::END, 0, 0, 0 });
+            break;
+        }
+    }
+    return finish(std::move(block));
+}
+
+RvBlock *RvBlockCache::adopt(uint64_t pc, std::vector<RvDecodedInst> insts)
+{
+    if (insts.empty() || insts.size() > RvBlock::MAX_LEN + 1 || (pc & 3) || breakpoint.contains(pc) || blocks.contains(pc))
+        return nullptr;
+    // Only take the shape build would give with the current breakpoints
+    for (size_t i{ 0 }; i < insts.size(); i++) {
+        auto &inst{ insts[i] };
+        auto inst_pc{ pc + i * 4 };
+        bool last{ i + 1 == insts.size() };
+        bool cut{ (inst_pc & 0xfff) == 0 || i == RvBlock::MAX_LEN || breakpoint.contains(inst_pc) };
+        if (inst.op == RvBlock::END) {
+            if (!last || !i || !cut)
+                return nullptr;
+            inst.handler = nullptr;
+            continue;
+        }
+        if (i && cut)
+            return nullptr;
+        inst = RvDecodedInst::make(inst.op, inst.rd == RvBlockContext::ZERO_SINK ? 0 : inst.rd, inst.rs1, inst.rs2, inst.imm);
+        if (inst.rd > 31 || inst.rs1 > 31 || inst.rs2 > 31 || ends_block(inst) != last)
+            return nullptr;
+        if (inst.rd == 0)
+            inst.rd = RvBlockContext::ZERO_SINK;
+    }
+    auto block{ std::make_unique<RvBlock>() };
+    block->start_pc = pc;
+    block->id = next_id++;
+    block->insts = std::move(insts);
+    return &finish(std::move(block));
+}
+
+RvBlock &RvBlockCache::finish(std::unique_ptr<RvBlock> block)
+{
+    block->gen = mem.generation(block->start_pc);
+    block->length = block->insts.back().op == RvBlock::END ? block->insts.size() - 1 : block->insts.size();
+    // Pairs never span blocks, so state is exact wherever a block is left or entered
+    block->fused = 0;
+    for (size_t i{ 1 }; i < block->length; i++) {
+        auto &first{ block->insts[i - 1] };
+        auto op{ fused_op(first, block->insts[i]) };
+        if (op == first.op)
+            continue;
+        first.op = op;
+        block->fused += 2;
+        i++;
+    }
+    block->link_pc[0] = block->link_pc[1] = block->jalr_pc = RvBlock::NO_LINK;
+    auto &last{ block->insts[block->length - 1] };
+    auto last_pc{ block->start_pc + (block->length - 1) * 4 };
+    if (last.is_branch()) {
+        block->link_pc[0] = last.get_target(last_pc);
+        block->link_pc[1] = last_pc + 4;
+    }
+    else if (last.op == RvOp::JAL)
+        block->link_pc[0] = last_pc + last.imm;
+    if ((last.op == RvOp::JAL || last.op == RvOp::JALR) && last.rd == RvBlockContext::RA)
+        block->link_pc[1] = last_pc + 4;
+    else if (block->insts.back().op == RvBlock::END)
+        block->link_pc[1] = last_pc + 4;
+    auto &slot{ blocks[block->start_pc] };
+    slot = std::move(block);
+    return *slot;
+}
+
+void RvBlockCache::link(RvBlock &prev, RvBlock &block)
+{
+    // Breakpoints are checked when entering blocks from outside
+    if (block.breakpoint)
+        return;
+    bool linked{};
+    for (int i{ 0 }; i < 2; i++)
+        if (prev.link_pc[i] == block.start_pc) {
+            prev.link[i] = &block;
+            linked = true;
+        }
+    if (!linked && prev.insts[prev.length - 1].op == RvOp::JALR) {
+        prev.jalr_pc = block.start_pc;
+        prev.jalr_block = &block;
+    }
+}
+
+void RvBlockCache::clear()
+{
+    blocks.clear();
+    ras_depth = 0;
+    epoch = mem.code_generation();
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "RvInst.h"
+#include "RvMem.h"
+#include "RvDecodeCache.h"
+
+// Guest registers of block engines.
+// Blocks redirect writes to x0 into x[ZERO_SINK], so x[0] stays 0.
+struct RvBlockContext {
+    static constexpr uint8_t ZERO_SINK{ 32 };
+    // Link register of calls and returns
+    static constexpr uint8_t RA{ 1 };
+    uint64_t x[33];
+    uint64_t pc;
+};
+
+// Straight-line decoded instructions within one page. A block ends at a
+// control-flow inst or fault, at the page end, after MAX_LEN insts, or
+// right before a breakpoint, so breakpoints can only hit at start_pc.
+struct RvBlock {
+    static constexpr size_t MAX_LEN{ 64 };
+    // op of the extra inst closing a block that falls through
+    static constexpr RvOp END{ RvOp::BLOCK_END };
+    // ops of fused pairs. They replace the op of the first inst and run the
+    // second one too, which stays in place so insts still map 1:1 to pcs
+    static constexpr RvOp LUI_ADDI{ RvOp::LUI_ADDI };
+    static constexpr RvOp AUIPC_ADDI{ RvOp::AUIPC_ADDI };
+    static constexpr RvOp AUIPC_JALR{ RvOp::AUIPC_JALR };
+    static constexpr RvOp SLLI_SRLI{ RvOp::SLLI_SRLI };
+    // Compare, then beqz/bnez on its result
+    static constexpr RvOp SLT_BRANCH{ RvOp::SLT_BRANCH };
+    static constexpr RvOp SLTU_BRANCH{ RvOp::SLTU_BRANCH };
+    static constexpr RvOp SLTI_BRANCH{ RvOp::SLTI_BRANCH };
+    static constexpr size_t OP_COUNT{ static_cast<size_t>(RvOp::BLOCK_COUNT) };
+    // op of the first inst of a fused pair, other ops are returned as is
+    static RvOp unfused(RvOp op);
+    uint64_t start_pc;
+    uint64_t gen;
+    // Unique among all blocks a cache ever built
+    uint64_t id;
+    // Guest insts in the block, not counting the END inst
+    size_t length;
+    // Guest insts run by fused pairs each time the block runs through
+    size_t fused;
+    bool breakpoint;
+    std::vector<RvDecodedInst> insts;
+    // Times the block was entered, for picking hot blocks
+    uint64_t exec_count;
+    // Translated host code, if any
+    void *native;
+    // Waiting to be translated on another thread
+    bool queued;
+    // Static successors, [0] is the taken branch or jal target and [1] falls
+    // through, or is where a call returns to. Linked once both blocks ran,
+    // link_pc is NO_LINK if there's no such exit
+    static constexpr uint64_t NO_LINK{ ~uint64_t{} };
+    uint64_t link_pc[2];
+    RvBlock *link[2];
+    // Inline cache of the ending jalr, the last target and its block
+    uint64_t jalr_pc;
+    RvBlock *jalr_block;
+};
+
+class RvBlockCache {
+    RvMem &mem;
+    std::shared_ptr<RvDecodeCache> icache;
+    const std::set<uint64_t> &breakpoint;
+    std::unordered_map<uint64_t, std::unique_ptr<RvBlock>> blocks;
+    // Code generation of RvMem the blocks and links were checked against
+    uint64_t epoch;
+    uint64_t next_id;
+    // Shadow return stack of blocks ending with a call, oldest calls are
+    // dropped once it's full
+    struct ras_entry {
+        uint64_t ret_pc;
+        RvBlock *caller;
+    };
+    std::array<ras_entry, 64> ras;
+    size_t ras_top;
+    size_t ras_depth;
+    // Insts of block are in place, fill in the rest and add it
+    RvBlock &finish(std::unique_ptr<RvBlock> block);
+    RvBlockCache(const RvBlockCache &) = delete;
+    RvBlockCache &operator=(const RvBlockCache &) = delete;
+public:
+    RvBlockCache(RvMem &mem, std::shared_ptr<RvDecodeCache> icache, const std::set<uint64_t> &breakpoint);
+    uint64_t get_epoch() const { return epoch; }
+    // Some page changed since blocks were checked, links mustn't be followed
+    bool stale() const { return epoch != mem.code_generation(); }
+    // Drop blocks of changed pages and unlink the rest
+    void revalidate();
+    // Cached block at pc, nullptr if there's none. Only valid if not stale
+    RvBlock *find(uint64_t pc);
+    // Decode the block at pc, throws like RvDecodeCache::fetch
+    RvBlock &build(uint64_t pc);
+    // Add the block at pc from insts decoded earlier, with their unfused ops.
+    // nullptr if there's a block at pc or build would cut it differently
+    RvBlock *adopt(uint64_t pc, std::vector<RvDecodedInst> insts);
+    template <typename F>
+    void for_each(F fn) const
+    {
+        for (auto &[pc, block] : blocks)
+            fn(*block);
+    }
+    // Link block as the successor of prev it was reached from
+    void link(RvBlock &prev, RvBlock &block);
+    void push_return(uint64_t ret_pc, RvBlock &caller)
+    {
+        ras_top = (ras_top + 1) % ras.size();
+        ras[ras_top] = { ret_pc, &caller };
+        if (ras_depth < ras.size())
+            ras_depth++;
+    }
+    // Caller of the innermost call if it returns to ret_pc, nullptr otherwise.
+    // Pops the call either way
+    RvBlock *pop_return(uint64_t ret_pc)
+    {
+        if (!ras_depth)
+            return nullptr;
+        auto &top{ ras[ras_top] };
+        ras_top = (ras_top + ras.size() - 1) % ras.size();
+        ras_depth--;
+        return top.ret_pc == ret_pc ? top.caller : nullptr;
+    }
+    // Needed when breakpoints change
+    void clear();
+};
@@ -0,0 +1,147 @@
+#include "RvCodeCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <system_error>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RV_CODE_CACHE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char MAGIC[4]{ 'R', 'V', 'C', 'C' };
+static_assert(std::is_trivially_copyable_v<RvCodeCache::header_t>);
+static_assert(std::is_trivially_copyable_v<RvCodeCache::block_t>);
+static_assert(std::is_trivially_copyable_v<RvCodeCache::inst_t>);
+
+RvCodeCache::RvCodeCache(const std::filesystem::path &dir, uint64_t key)
+    : key{ key }
+    , data{}
+    , size{}
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.rvcc", static_cast<unsigned long long>(key));
+    path = dir / name;
+}
+
+RvCodeCache::~RvCodeCache()
+{
+    unmap();
+}
+
+void RvCodeCache::unmap()
+{
+#ifdef RV_CODE_CACHE_MMAP
+    if (data && buffer.empty())
+        ::munmap(const_cast<char *>(data), size);
+#endif
+    buffer.clear();
+    data = nullptr;
+    size = 0;
+}
+
+uint64_t RvCodeCache::hash(const void *data, size_t size, uint64_t seed)
+{
+    auto bytes{ static_cast<const unsigned char *>(data) };
+    for (size_t i{ 0 }; i < size; i++) {
+        seed ^= bytes[i];
+        seed *= 0x100000001b3;
+    }
+    return seed;
+}
+
+bool RvCodeCache::load()
+{
+    unmap();
+#ifdef RV_CODE_CACHE_MMAP
+    int fd{ ::open(path.c_str(), O_RDONLY) };
+    if (fd < 0)
+        return false;
+    struct stat st {};
+    void *base{ MAP_FAILED };
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        base = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+        return false;
+    data = static_cast<const char *>(base);
+    size = st.st_size;
+#else
+    std::ifstream fin(path, std::ios::binary);
+    if (!fin)
+        return false;
+    buffer.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    if (buffer.empty())
+        return false;
+    data = buffer.data();
+    size = buffer.size();
+#endif
+    header_t header;
+    bool valid{ size >= sizeof(header) };
+    if (valid) {
+        std::memcpy(&header, data, sizeof(header));
+        valid = !std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) && header.version == VERSION && header.key == key
+            && header.block_count <= size / sizeof(block_t) && header.inst_count <= size / sizeof(inst_t)
+            && size == sizeof(header) + header.block_count * sizeof(block_t) + header.inst_count * sizeof(inst_t);
+    }
+    for (auto &block : valid ? blocks() : std::span<const block_t>{})
+        if (block.first_inst > header.inst_count || block.inst_count > header.inst_count - block.first_inst) {
+            valid = false;
+            break;
+        }
+    if (!valid)
+        unmap();
+    return valid;
+}
+
+std::span<const RvCodeCache::block_t> RvCodeCache::blocks() const
+{
+    if (!data)
+        return {};
+    header_t header;
+    std::memcpy(&header, data, sizeof(header));
+    return { reinterpret_cast<const block_t *>(data + sizeof(header)), header.block_count };
+}
+
+std::span<const RvCodeCache::inst_t> RvCodeCache::insts(const block_t &block) const
+{
+    header_t header;
+    std::memcpy(&header, data, sizeof(header));
+    auto base{ reinterpret_cast<const inst_t *>(data + sizeof(header) + header.block_count * sizeof(block_t)) };
+    return { base + block.first_inst, block.inst_count };
+}
+
+bool RvCodeCache::save(const std::vector<block_t> &blocks, const std::vector<inst_t> &insts)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    // Writers each fill their own file, the last rename wins
+    auto tmp{ path };
+    tmp += ".tmp" + std::to_string(std::random_device{}());
+    {
+        std::ofstream fout(tmp, std::ios::binary | std::ios::trunc);
+        header_t header{ {}, VERSION, key, blocks.size(), insts.size() };
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        fout.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        fout.write(reinterpret_cast<const char *>(blocks.data()), blocks.size() * sizeof(block_t));
+        fout.write(reinterpret_cast<const char *>(insts.data()), insts.size() * sizeof(inst_t));
+        if (!fout.flush()) {
+            fout.close();
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (!ec)
+        return true;
+    std::filesystem::remove(tmp, ec);
+    return false;
+}
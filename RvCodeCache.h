@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+#include "RvInst.h"
+
+// Decoded blocks of a program saved across runs, in one file per program
+// keyed by a hash of its loaded segments. Translated code holds host
+// addresses of this run, so hot blocks are translated again when loaded.
+// Files are replaced by renaming a complete copy, so concurrent runs
+// never see partial ones.
+class RvCodeCache {
+public:
+    // Bump whenever the layout below or RvOp changes
+    static constexpr uint32_t VERSION{ 2 };
+    struct header_t {
+        char magic[4];
+        uint32_t version;
+        uint64_t key;
+        uint64_t block_count;
+        uint64_t inst_count;
+    };
+    struct block_t {
+        uint64_t start_pc;
+        uint64_t exec_count;
+        uint64_t first_inst;
+        uint64_t inst_count;
+    };
+    // raw is checked against guest memory before the decoded fields are used
+    struct inst_t {
+        uint32_t raw;
+        RvOp op;
+        uint8_t rd;
+        uint8_t rs1;
+        uint8_t rs2;
+        int64_t imm;
+    };
+private:
+    std::filesystem::path path;
+    uint64_t key;
+    // Mapped or read file, empty if there's no valid one
+    const char *data;
+    size_t size;
+    std::vector<char> buffer;
+    void unmap();
+    RvCodeCache(const RvCodeCache &) = delete;
+    RvCodeCache &operator=(const RvCodeCache &) = delete;
+public:
+    RvCodeCache(const std::filesystem::path &dir, uint64_t key);
+    ~RvCodeCache();
+    // FNV-1a, chain seed through calls to hash several pieces
+    static uint64_t hash(const void *data, size_t size, uint64_t seed = 0xcbf29ce484222325);
+    // Map the file of key, false if it's missing, of another version or broken
+    bool load();
+    std::span<const block_t> blocks() const;
+    std::span<const inst_t> insts(const block_t &block) const;
+    // Replace the file of key, false if it can't be written
+    bool save(const std::vector<block_t> &blocks, const std::vector<inst_t> &insts);
+};
@@ -1,5 +1,6 @@
 #include "RvCpu.h"
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <span>
@@ -7,6 +8,8 @@
 #include <string>
 
 #include "RvInst.h"
+#include "RvDecodeCache.h"
+#include "RvOpTable.hpp"
 
 using namespace std::string_literals;
 
@@ -109,44 +112,37 @@ bool RvBaseCpu::remove_breakpoint(uint64_t addr)
     return true;
 }
 
+void RvBaseCpu::report_syscall()
+{
+    std::cerr << "Program issued a syscall." << std::endl;
+    for (int i{ 0 }; i < 32; i++) {
+        std::cout << RVREGABINAME[i] << "=0x" << std::hex << static_cast<uint64_t>(reg[i]) << std::endl;
+    }
+    std::cout << "pc=0x" << std::hex << reg.pc << std::endl;
+    // Syscall no. at a7, return value at a0
+}
+
 #pragma endregion
 
 #pragma region RvSimpleCpu
 
-RvSimpleCpu::RvSimpleCpu(RvMem &mem, const RvReg &reg)
+RvSimpleCpu::RvSimpleCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache)
     : RvBaseCpu(mem, reg)
+    , icache{ icache ? icache : std::make_shared<RvDecodeCache>(mem) }
 {
     return;
 }
 
 void RvSimpleCpu::step()
 {
-    std::unique_ptr<RvInst> inst{ RvInst::decode(mem.fetch(reg.pc)) };
-    std::cout << inst->name() << std::endl;
-    try {
-        inst->exec(reg);
-        reg.pc += 4;
-    }
-    catch (const RvMemAcc &meminfo) {
-        inst->mem(reg, mem, meminfo);
-        reg.pc += 4;
-    }
-    catch (const RvCtrlFlowJmp &info) {
-        reg.pc = info.target_addr;
-    }
-    catch (const RvHalt &e) {
-        reg.pc += 4;
-        throw;
-    }
-    catch (const RvSysCall &syscall) {
-        reg.pc += 4;
-        std::cerr << "Program issued a syscall." << std::endl;
-        for (int i{ 0 }; i < 32; i++) {
-            std::cout << RVREGABINAME[i] << "=0x" << std::hex << static_cast<uint64_t>(reg[i]) << std::endl;
-        }
-        std::cout << "pc=0x" << std::hex << reg.pc << std::endl;
-        // Syscall no. at a7, return value at a0
-    }
+    const RvDecodedInst &inst{ icache->fetch(reg.pc) };
+    std::cout << inst.name() << std::endl;
+    auto result{ inst.exec(reg) };
+    if (result.mem_acc)
+        inst.mem(reg, mem, *result.mem_acc);
+    reg.pc = result.next_pc;
+    if (result.trap == RvExecResult::T_ECALL)
+        report_syscall();
 }
 
 uint64_t RvSimpleCpu::exec(uint64_t cycle, bool no_bp)
@@ -179,70 +175,606 @@ uint64_t RvSimpleCpu::exec(uint64_t cycle, bool no_bp)
 
 #pragma endregion
 
-#pragma region RvMultiCycleCpu
+#pragma region RvThreadedCpu
 
-RvMultiCycleCpu::RvMultiCycleCpu(RvMem &mem, const RvReg &reg)
+RvThreadedCpu::RvThreadedCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache)
     : RvBaseCpu(mem, reg)
-    , executed_cycles{}
-    , executed_insts{}
-    , inst_stat{}
+    , icache{ icache ? icache : std::make_shared<RvDecodeCache>(mem) }
+    , blocks{ mem, this->icache, breakpoint }
+    , ctx{}
+    , build_threshold{}
+    , hot_threshold{ ~uint64_t{} }
+    , fused_insts{}
+    , tier_stat{}
 {
     return;
 }
 
-void RvMultiCycleCpu::step()
+bool RvThreadedCpu::add_breakpoint(uint64_t addr)
 {
-    std::unique_ptr<RvInst> inst1{ RvInst::decode(mem.fetch(reg.pc)) };
-    std::unique_ptr<RvInst> inst2;
-    try {
-        executed_cycles += 2;
+    // Blocks are split at breakpoints
+    blocks.clear();
+    return RvBaseCpu::add_breakpoint(addr);
+}
+
+bool RvThreadedCpu::remove_breakpoint(uint64_t addr)
+{
+    blocks.clear();
+    return RvBaseCpu::remove_breakpoint(addr);
+}
+
+uint64_t RvThreadedCpu::get_fused_count() const
+{
+    return fused_insts;
+}
+
+const std::array<RvThreadedCpu::tier_stat_t, RvThreadedCpu::T_COUNT> &RvThreadedCpu::get_tier_stat() const
+{
+    return tier_stat;
+}
+
+void RvThreadedCpu::load_blocks(const RvCodeCache &cache)
+{
+    if (blocks.stale())
+        blocks.revalidate();
+    for (auto &saved : cache.blocks()) {
+        std::vector<RvDecodedInst> insts;
+        bool match{ true };
+        for (auto &inst : cache.insts(saved)) {
+            // The END inst isn't fetched
+            if (inst.op != RvBlock::END)
+                try {
+                    match = match && mem.fetch(saved.start_pc + insts.size() * 4) == inst.raw;
+                }
+                catch (const RvException &e) {
+                    match = false;
+                }
+            insts.push_back({ nullptr, inst.imm, inst.op, inst.rd, inst.rs1, inst.rs2 });
+        }
+        if (!match)
+            continue;
+        if (auto block{ blocks.adopt(saved.start_pc, std::move(insts)) }) {
+            block->exec_count = saved.exec_count;
+            adopted(*block);
+        }
+    }
+}
+
+bool RvThreadedCpu::save_blocks(RvCodeCache &cache)
+{
+    std::vector<RvCodeCache::block_t> saved;
+    std::vector<RvCodeCache::inst_t> insts;
+    blocks.for_each([&](const RvBlock &block) {
+        auto first{ insts.size() };
         try {
-            inst2.reset(RvInst::decode(reg.pc + 4));
+            // Blocks of changed code are dropped on the next lookup anyway
+            if (block.gen != mem.generation(block.start_pc))
+                return;
+            for (size_t i{ 0 }; i < block.insts.size(); i++) {
+                auto &inst{ block.insts[i] };
+                uint32_t raw{ inst.op == RvBlock::END ? 0 : mem.fetch(block.start_pc + i * 4) };
+                insts.push_back({ raw, RvBlock::unfused(inst.op), inst.rd, inst.rs1, inst.rs2, inst.imm });
+            }
+        }
+        catch (const RvException &e) {
+            insts.resize(first);
+            return;
+        }
+        saved.push_back({ block.start_pc, block.exec_count, first, block.insts.size() });
+    });
+    return cache.save(saved, insts);
+}
+
+void RvThreadedCpu::load_context()
+{
+    for (uint8_t i{ 0 }; i < 32; i++)
+        ctx.x[i] = reg[i];
+    ctx.pc = reg.pc;
+}
+
+void RvThreadedCpu::store_context()
+{
+    for (uint8_t i{ 1 }; i < 32; i++)
+        reg[i] = ctx.x[i];
+    reg.pc = ctx.pc;
+}
+
+template <typename T>
+static T load(RvMem &mem, uint64_t addr)
+{
+    if (addr & (sizeof(T) - 1))
+        throw RvMisAlign(addr);
+    return static_cast<T>(mem[addr]);
+}
+
+template <typename T>
+static void store(RvMem &mem, uint64_t addr, uint64_t value)
+{
+    if (addr & (sizeof(T) - 1))
+        throw RvMisAlign(addr);
+    mem[addr] = static_cast<T>(value);
+}
+
+// Every op handled by run_block
+#define RV_THREADED_OPS(X) \
+    X(ADD) X(MUL) X(SUB) X(SLL) X(MULH) X(SLT) X(SLTU) X(XOR) X(DIV) X(SRL) X(DIVU) X(SRA) X(OR) X(REM) X(AND) X(REMU) \
+    X(ADDW) X(MULW) X(SUBW) X(DIVW) X(REMW) \
+    X(ADDI) X(SLTI) X(XORI) X(ORI) X(ANDI) X(SLLI) X(SRLI) X(SRAI) \
+    X(ADDIW) X(SLLIW) X(SRLIW) X(SRAIW) \
+    X(LB) X(LH) X(LW) X(LD) X(LBU) X(LHU) X(LWU) \
+    X(SB) X(SH) X(SW) X(SD) \
+    X(BEQ) X(BNE) X(BLT) X(BGE) X(BLTU) X(BGEU) \
+    X(JALR) X(ECALL) X(AUIPC) X(LUI) X(JAL) X(FENCE_I) \
+    X(ILLEGAL) X(MEM_FAULT) X(COUNT)
+// Fused pairs of RvBlock, the RvOp enumerators after RvBlock::END
+#define RV_FUSED_OPS(X) \
+    X(LUI_ADDI) X(AUIPC_ADDI) X(AUIPC_JALR) X(SLLI_SRLI) X(SLT_BRANCH) X(SLTU_BRANCH) X(SLTI_BRANCH)
+
+// Each handler jumps straight to the next one with computed goto where the
+// compiler supports it, otherwise it falls back to a switch loop
+#ifdef __GNUC__
+#define RV_OP(name) op_##name:
+#define RV_FUSED_OP(name) op_##name:
+#define RV_DISPATCH() goto *dispatch[static_cast<size_t>(inst->op)]
+#else
+#define RV_OP(name) case RvOp::name:
+#define RV_FUSED_OP(name) case RvBlock::name:
+#define RV_DISPATCH() continue
+#endif
+#define RV_NEXT() ++inst; RV_DISPATCH()
+// Past the second inst of a fused pair
+#define RV_NEXT_PAIR() inst += 2; RV_DISPATCH()
+
+#define RV_R(name) RV_OP(name) { \
+    constexpr auto fn{ r_entry(RvOp::name).fn }; \
+    x[inst->rd] = fn(x[inst->rs1], x[inst->rs2]); \
+    RV_NEXT(); }
+#define RV_I(name) RV_OP(name) { \
+    constexpr auto fn{ i_entry(RvOp::name).fn }; \
+    x[inst->rd] = fn(x[inst->rs1], inst->imm); \
+    RV_NEXT(); }
+#define RV_LOAD(name, type) RV_OP(name) { \
+    x[inst->rd] = load<type>(mem, x[inst->rs1] + inst->imm); \
+    RV_NEXT(); }
+#define RV_STORE(name, type) RV_OP(name) { \
+    store<type>(mem, x[inst->rs1] + inst->imm, x[inst->rs2]); \
+    RV_NEXT(); }
+#define RV_BRANCH(name) RV_OP(name) { \
+    constexpr auto fn{ sb_entry(RvOp::name).fn }; \
+    if (fn(x[inst->rs1], x[inst->rs2])) \
+        RV_CHAIN(block->link[0], pc_of() + inst->imm) \
+    RV_CHAIN(block->link[1], pc_of() + 4) }
+// Compare into rd, then beqz/bnez rd
+#define RV_CMP_BRANCH(name, cmp, operand) RV_FUSED_OP(name) { \
+    constexpr auto fn{ cmp.fn }; \
+    bool cond{ fn(x[inst->rs1], operand) != 0 }; \
+    x[inst->rd] = cond; \
+    ++inst; \
+    if (cond == (inst->op == RvOp::BNE)) \
+        RV_CHAIN(block->link[0], pc_of() + inst->imm) \
+    RV_CHAIN(block->link[1], pc_of() + 4) }
+// Leave the block for target, continuing right into next if it's linked
+#define RV_CHAIN(next_block, target) { \
+    uint64_t next_pc{ target }; \
+    RvBlock *next{ next_block }; \
+    inst_exec += block->length; \
+    fused_insts += block->fused; \
+    if (next && chainable(*next)) { \
+        block = next; \
+        base = inst = next->insts.data(); \
+        next->exec_count++; \
+        RV_DISPATCH(); \
+    } \
+    ctx.pc = next_pc; \
+    return block; }
+
+RvBlock *RvThreadedCpu::run_block(RvBlock &entry, uint64_t &inst_exec, uint64_t limit)
+{
+    auto &x{ ctx.x };
+    RvBlock *block{ &entry };
+    const RvDecodedInst *base{ block->insts.data() };
+    const RvDecodedInst *inst{ base };
+    auto pc_of{ [&] { return block->start_pc + ((inst - base) << 2); } };
+    // Hot blocks go back to exec() so subclasses can take them over
+    auto chainable{ [&](const RvBlock &next) {
+        return !next.native && next.exec_count < hot_threshold && inst_exec + next.length <= limit && !blocks.stale();
+    } };
+    try {
+#ifdef __GNUC__
+#define RV_LABEL(name) &&op_##name,
+        static void *const dispatch[]{ RV_THREADED_OPS(RV_LABEL) RV_FUSED_OPS(RV_LABEL) };
+#undef RV_LABEL
+        static_assert(std::size(dispatch) == RvBlock::OP_COUNT);
+        goto *dispatch[static_cast<size_t>(inst->op)];
+#else
+        for (;;) switch (inst->op) {
+#endif
+        RV_R(ADD) RV_R(MUL) RV_R(SUB) RV_R(SLL) RV_R(MULH) RV_R(SLT) RV_R(SLTU) RV_R(XOR)
+        RV_R(DIV) RV_R(SRL) RV_R(DIVU) RV_R(SRA) RV_R(OR) RV_R(REM) RV_R(AND) RV_R(REMU)
+        RV_R(ADDW) RV_R(MULW) RV_R(SUBW) RV_R(DIVW) RV_R(REMW)
+        RV_I(ADDI) RV_I(SLTI) RV_I(XORI) RV_I(ORI) RV_I(ANDI) RV_I(SLLI) RV_I(SRLI) RV_I(SRAI)
+        RV_I(ADDIW) RV_I(SLLIW) RV_I(SRLIW) RV_I(SRAIW)
+        RV_LOAD(LB, int8_t) RV_LOAD(LH, int16_t) RV_LOAD(LW, int32_t) RV_LOAD(LD, uint64_t)
+        RV_LOAD(LBU, uint8_t) RV_LOAD(LHU, uint16_t) RV_LOAD(LWU, uint32_t)
+        RV_STORE(SB, uint8_t) RV_STORE(SH, uint16_t) RV_STORE(SW, uint32_t) RV_STORE(SD, uint64_t)
+        RV_BRANCH(BEQ) RV_BRANCH(BNE) RV_BRANCH(BLT) RV_BRANCH(BGE) RV_BRANCH(BLTU) RV_BRANCH(BGEU)
+        RV_OP(JALR) jalr: {
+            // rd may be rs1
+            uint64_t target{ x[inst->rs1] + inst->imm };
+            x[inst->rd] = pc_of() + 4;
+            if (inst->rd == RvBlockContext::RA)
+                blocks.push_return(pc_of() + 4, *block);
+            else if (inst->rd == RvBlockContext::ZERO_SINK && inst->rs1 == RvBlockContext::RA) {
+                // Return to the block after the call, which is linked on the first return there
+                if (auto caller{ blocks.pop_return(target) }) {
+                    if (!caller->link[1] && !blocks.stale())
+                        if (auto next{ blocks.find(target) })
+                            blocks.link(*caller, *next);
+                    RV_CHAIN(caller->link[1], target)
+                }
+            }
+            RV_CHAIN(block->jalr_pc == target ? block->jalr_block : nullptr, target)
+        }
+        RV_OP(ECALL) {
+            ctx.pc = pc_of() + 4;
+            inst_exec += block->length;
+            fused_insts += block->fused;
+            store_context();
+            report_syscall();
+            return block;
+        }
+        RV_OP(AUIPC) {
+            x[inst->rd] = pc_of() + inst->imm;
+            RV_NEXT();
+        }
+        RV_OP(LUI) {
+            x[inst->rd] = inst->imm;
+            RV_NEXT();
+        }
+        RV_OP(JAL) {
+            x[inst->rd] = pc_of() + 4;
+            if (inst->rd == RvBlockContext::RA)
+                blocks.push_return(pc_of() + 4, *block);
+            RV_CHAIN(block->link[0], pc_of() + inst->imm)
+        }
+        RV_OP(FENCE_I) {
+            // Back to exec(), which drops blocks whose code was written
+            ctx.pc = pc_of() + 4;
+            inst_exec += block->length;
+            fused_insts += block->fused;
+            return block;
+        }
+        RV_OP(ILLEGAL)
+        RV_OP(MEM_FAULT) {
+            throw RvIllIns(pc_of());
+        }
+        // RvBlock::END
+        RV_OP(COUNT) {
+            RV_CHAIN(block->link[1], pc_of())
+        }
+        RV_FUSED_OP(LUI_ADDI) {
+            x[inst->rd] = inst->imm + inst[1].imm;
+            RV_NEXT_PAIR();
         }
-        catch (const RvException &) {
-            ;
+        RV_FUSED_OP(AUIPC_ADDI) {
+            x[inst->rd] = pc_of() + inst->imm + inst[1].imm;
+            RV_NEXT_PAIR();
         }
-        if (inst2 && inst1->div_rem_ok(inst2.get())) {
-            inst2->exec(reg);
-            reg.pc += 4;
-            executed_cycles += 4;
-            executed_insts++;
-            inst_stat[inst1->inst_name()]++;
+        RV_FUSED_OP(AUIPC_JALR) {
+            x[inst->rd] = pc_of() + inst->imm;
+            ++inst;
+            goto jalr;
         }
-        inst1->exec(reg);
-        // if have memory access or branch, subsequent code won't be executed
-        executed_cycles += inst1->exec_cycle() + (dynamic_cast<RvSBInst *>(inst1.get()) ? 0 : 2);
+        RV_FUSED_OP(SLLI_SRLI) {
+            constexpr auto sll{ i_entry(RvOp::SLLI).fn };
+            constexpr auto srl{ i_entry(RvOp::SRLI).fn };
+            x[inst->rd] = srl(sll(x[inst->rs1], inst->imm), inst[1].imm);
+            RV_NEXT_PAIR();
+        }
+        RV_CMP_BRANCH(SLT_BRANCH, r_entry(RvOp::SLT), x[inst->rs2])
+        RV_CMP_BRANCH(SLTU_BRANCH, r_entry(RvOp::SLTU), x[inst->rs2])
+        RV_CMP_BRANCH(SLTI_BRANCH, i_entry(RvOp::SLTI), inst->imm)
+#ifndef __GNUC__
+        }
+#endif
+    }
+    catch (const RvException &e) {
+        // Precise state for the faulting inst
+        ctx.pc = pc_of();
+        inst_exec += inst - base;
+        throw;
+    }
+}
 
-        // Finally
-        reg.pc += 4;
-        executed_insts++;
-        inst_stat[inst1->inst_name()]++;
+#undef RV_THREADED_OPS
+#undef RV_FUSED_OPS
+#undef RV_OP
+#undef RV_FUSED_OP
+#undef RV_DISPATCH
+#undef RV_NEXT
+#undef RV_NEXT_PAIR
+#undef RV_R
+#undef RV_I
+#undef RV_LOAD
+#undef RV_STORE
+#undef RV_BRANCH
+#undef RV_CMP_BRANCH
+#undef RV_CHAIN
+
+void RvThreadedCpu::step()
+{
+    const RvDecodedInst &inst{ icache->fetch(reg.pc) };
+    auto result{ inst.exec(reg) };
+    if (result.mem_acc)
+        inst.mem(reg, mem, *result.mem_acc);
+    reg.pc = result.next_pc;
+    if (result.trap == RvExecResult::T_ECALL)
+        report_syscall();
+}
+
+uint64_t RvThreadedCpu::exec(uint64_t cycle, bool no_bp)
+{
+    uint64_t inst_exec{};
+    uint64_t limit{ cycle ? cycle : ~uint64_t{} };
+    // reg is up to date once we fall back to step()
+    bool stepping{};
+    // Block the last run left from, to be linked to the next one
+    RvBlock *prev{};
+    // Insts are counted on every dispatch, but the clock is only read when
+    // the tier changes, so staying in one tier costs no clock reads
+    tier_t tier{ T_COUNT };
+    std::chrono::steady_clock::time_point since{};
+    auto enter{ [&](tier_t next) {
+        if (next == tier)
+            return;
+        auto now{ std::chrono::steady_clock::now() };
+        if (tier != T_COUNT)
+            tier_stat[tier].time += now - since;
+        tier = next;
+        since = now;
+    } };
+    load_context();
+    try {
+        for (;;) {
+            if (blocks.stale()) {
+                blocks.revalidate();
+                prev = nullptr;
+            }
+            auto block{ blocks.find(ctx.pc) };
+            if (!no_bp && (block ? block->breakpoint : find_breakpoint(ctx.pc)))
+                break;
+            // Blocks stay on the 4 byte grid, so none holds an inst crossing a page end
+            bool off_grid{ (ctx.pc & 3) != 0 };
+            if (!block && (off_grid || (build_threshold && cold_entries[ctx.pc]++ < build_threshold))) {
+                // Cold code runs inst by inst up to the next control transfer
+                enter(T_INTERP);
+                auto before{ inst_exec };
+                store_context();
+                stepping = true;
+                for (;;) {
+                    auto pc{ reg.pc };
+                    step();
+                    inst_exec++;
+                    if (reg.pc != pc + 4 || (reg.pc & 0xfff) == 0 || inst_exec == limit)
+                        break;
+                    if (!no_bp && find_breakpoint(reg.pc))
+                        break;
+                }
+                stepping = false;
+                load_context();
+                tier_stat[T_INTERP].insts += inst_exec - before;
+                prev = nullptr;
+                if (inst_exec == limit)
+                    break;
+                continue;
+            }
+            if (!block) {
+                cold_entries.erase(ctx.pc);
+                block = &blocks.build(ctx.pc);
+            }
+            if (prev)
+                blocks.link(*prev, *block);
+            if (cycle && cycle - inst_exec < block->length) {
+                // Budget runs out inside this block
+                enter(T_INTERP);
+                auto before{ inst_exec };
+                store_context();
+                stepping = true;
+                while (inst_exec < cycle) {
+                    step();
+                    inst_exec++;
+                }
+                tier_stat[T_INTERP].insts += inst_exec - before;
+                break;
+            }
+            block->exec_count++;
+            promote(*block);
+            // Translated blocks only chain to translated ones, threaded to threaded
+            auto ran{ block->native ? T_NATIVE : T_BLOCK };
+            enter(ran);
+            auto before{ inst_exec };
+            prev = run_block(*block, inst_exec, limit);
+            tier_stat[ran].insts += inst_exec - before;
+        }
     }
-    catch (const RvMemAcc &meminfo) {
-        inst1->mem(reg, mem, meminfo);
-        executed_cycles += mem.mem_cycle() + inst1->exec_cycle();
-        if (meminfo.rw == meminfo.READ)
-            executed_cycles++;
+    catch (const RvHalt &e) {
+        ;
+    }
+    catch (const RvException &e) {
+        std::cerr << "We encountered an exception " << typeid(e).name() << ", " << e.what() << std::endl;
+    }
+    if (!stepping)
+        store_context();
+    if (tier != T_COUNT)
+        tier_stat[tier].time += std::chrono::steady_clock::now() - since;
+    return inst_exec;
+}
 
-        // Finally
-        reg.pc += 4;
-        executed_insts++;
-        inst_stat[inst1->inst_name()]++;
+#pragma endregion
+
+#pragma region RvJitCpu
+
+RvJitCpu::RvJitCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache, uint64_t jit_threshold, size_t jit_threads)
+    : RvThreadedCpu(mem, reg, icache)
+    , jit{ mem }
+    , compiler{ jit_threads ? std::make_unique<RvJitCompiler>(jit, jit_threads) : nullptr }
+    , jit_stat{}
+{
+    hot_threshold = jit_threshold;
+    return;
+}
+
+void RvJitCpu::install()
+{
+    while (auto task{ compiler->poll() }) {
+        auto latency{ std::chrono::steady_clock::now() - task->queued };
+        jit_stat.total_latency += latency;
+        jit_stat.max_latency = std::max(jit_stat.max_latency, latency);
+        jit_stat.total_compile += task->compile_time;
+        // Blocks dropped or rebuilt meanwhile have a new id, if any
+        auto block{ blocks.find(task->code.start_pc) };
+        if (!block || block->id != task->block_id) {
+            jit_stat.dropped++;
+            continue;
+        }
+        block->queued = false;
+        block->native = task->native;
+        if (block->native)
+            jit_stat.installed++;
+        else {
+            // Try again later if it can't be translated
+            block->exec_count = 0;
+            jit_stat.dropped++;
+        }
     }
-    catch (const RvCtrlFlowJmp &info) {
-        reg.pc = info.target_addr;
-        executed_cycles += inst1->exec_cycle();
+}
 
-        // Finally
-        executed_insts++;
-        inst_stat[inst1->inst_name()]++;
+void RvJitCpu::translate(RvBlock &block)
+{
+    if (compiler) {
+        // The block stays interpreted until its code is installed
+        block.queued = compiler->submit(block);
+        jit_stat.max_depth = std::max(jit_stat.max_depth, compiler->depth());
+    }
+    else {
+        auto start{ std::chrono::steady_clock::now() };
+        block.native = jit.compile(block);
+        auto latency{ std::chrono::steady_clock::now() - start };
+        jit_stat.total_latency += latency;
+        jit_stat.max_latency = std::max(jit_stat.max_latency, latency);
+        jit_stat.total_compile += latency;
+        if (block.native)
+            jit_stat.installed++;
+        else
+            // Try again later if it can't be translated
+            block.exec_count = 0;
+    }
+}
+
+void RvJitCpu::adopted(RvBlock &block)
+{
+    // Hot in an earlier run, no need to warm up again
+    if (block.exec_count >= hot_threshold)
+        translate(block);
+}
+
+void RvJitCpu::promote(RvBlock &block)
+{
+    if (compiler)
+        install();
+    if (!block.native && !block.queued && block.exec_count >= hot_threshold)
+        translate(block);
+}
+
+RvBlock *RvJitCpu::run_block(RvBlock &block, uint64_t &inst_exec, uint64_t limit)
+{
+    if (!block.native)
+        return RvThreadedCpu::run_block(block, inst_exec, limit);
+    auto last{ jit.run(block.native, ctx, inst_exec, limit, blocks.get_epoch()) };
+    if (jit.state.syscall) {
+        store_context();
+        report_syscall();
+    }
+    return last;
+}
+
+uint64_t RvJitCpu::exec(uint64_t cycle, bool no_bp)
+{
+    // Mappings may have changed since the last run
+    jit.state.flush_tlb();
+    return RvThreadedCpu::exec(cycle, no_bp);
+}
+
+const RvJitCpu::jit_stat_t &RvJitCpu::get_jit_stat() const
+{
+    return jit_stat;
+}
+
+#pragma endregion
+
+#pragma region RvTieredCpu
+
+RvTieredCpu::RvTieredCpu(RvMem &mem, const RvReg &reg, uint64_t build_threshold, uint64_t jit_threshold, size_t jit_threads, std::shared_ptr<RvDecodeCache> icache)
+    : RvJitCpu(mem, reg, icache, jit_threshold, jit_threads)
+{
+    this->build_threshold = build_threshold;
+    return;
+}
+
+#pragma endregion
+
+#pragma region RvMultiCycleCpu
+
+RvMultiCycleCpu::RvMultiCycleCpu(RvMem &mem, const RvReg &reg)
+    : RvBaseCpu(mem, reg)
+    , executed_cycles{}
+    , executed_insts{}
+    , inst_stat{}
+{
+    return;
+}
+
+void RvMultiCycleCpu::step()
+{
+    auto inst1{ RvDecodedInst::decode(mem.fetch(reg.pc)) };
+    std::optional<RvDecodedInst> inst2;
+    // The next inst may lie past the end of the code, it just isn't paired then
+    try {
+        inst2 = RvDecodedInst::decode(mem.fetch(reg.pc + 4));
+    }
+    catch (const RvException &) {
+        ;
+    }
+    executed_cycles += 2;
+    auto result{ inst1.exec(reg) };
+    // Syscalls take no extra cycles
+    if (result.trap == RvExecResult::T_NONE) {
+        if (result.mem_acc) {
+            inst1.mem(reg, mem, *result.mem_acc);
+            executed_cycles += mem.mem_cycle() + inst1.exec_cycle();
+            if (result.mem_acc->rw == RvMemAcc::READ)
+                executed_cycles++;
+        }
+        else if (result.next_pc != reg.pc + 4)
+            executed_cycles += inst1.exec_cycle();
+        else
+            // if have memory access or branch, subsequent code won't be executed
+            executed_cycles += inst1.exec_cycle() + (inst1.is_branch() ? 0 : 2);
     }
-    catch (const RvSysCall &syscall) {
-        // Finally
-        reg.pc += 4;
+    // The rem reuses the quotient, div_rem_ok makes sure the div left its
+    // sources alone
+    if (inst1.div_rem_ok(inst2)) {
+        inst2->exec(reg);
+        result.next_pc += 4;
+        executed_cycles += 4;
         executed_insts++;
-        inst_stat[inst1->inst_name()]++;
+        inst_stat[inst2->inst_name()]++;
     }
+
+    // Finally
+    reg.pc = result.next_pc;
+    executed_insts++;
+    inst_stat[inst1.inst_name()]++;
 }
 
 uint64_t RvMultiCycleCpu::exec(uint64_t cycle, bool no_bp)
@@ -303,31 +835,26 @@ void RvMultiCycleCpu::reset_stat()
 void RvPipelineCpu::stage_fetch()
 {
     bool should_stall{ fetch_cycle > 0 };
-    RvInst *inst{};
+    RvDecodedInst inst;
     try {
-        inst = RvInst::decode(mem.fetch(fetch_pc));
+        inst = RvDecodedInst::decode(mem.fetch(fetch_pc));
     }
     catch (const RvAccVio &) {
-        inst = new RvMemFInst;
-        should_stall = true;
-        fetch_cycle = 1;
-    }
-    catch (const RvIllIns &) {
-        inst = new RvIllFInst;
+        inst = RvDecodedInst::fault(RvOp::MEM_FAULT);
         should_stall = true;
         fetch_cycle = 1;
     }
     catch (const RvMisAlign &) {
-        inst = new RvMemFInst;
+        inst = RvDecodedInst::fault(RvOp::MEM_FAULT);
         should_stall = true;
         fetch_cycle = 1;
     }
     fetch_cycle = std::max<uint64_t>(mem.mem_cycle() - 1, fetch_cycle);
-    fetch_inst.reset(inst);
+    fetch_inst = inst;
     fetch_reg.pc = fetch_pc;
     if (!should_stall) {
-        if (auto tmp_ptr{ dynamic_cast<RvSBInst *>(inst) })
-            fetch_pc = predictor->pred(fetch_pc, tmp_ptr->get_target(fetch_pc)) ? tmp_ptr->get_target(fetch_pc) : fetch_pc + 4;
+        if (inst.is_branch())
+            fetch_pc = predictor->pred(fetch_pc, inst.get_target(fetch_pc)) ? inst.get_target(fetch_pc) : fetch_pc + 4;
         else
             fetch_pc += 4;
     }
@@ -343,9 +870,9 @@ void RvPipelineCpu::stage_decode()
     decode_cycle--;
 }
 
-void RvPipelineCpu::stage_exec()
+std::optional<uint64_t> RvPipelineCpu::stage_exec()
 {
-    if (exec_inst && exec_inst->data_hazard(decode_inst.get()) == RvInst::H_RAW) {
+    if (exec_inst && exec_inst->data_hazard(decode_inst) == RvDecodedInst::H_RAW) {
         decode_cycle = 2;
         fetch_cycle = std::max<uint64_t>(fetch_cycle, 1);
     }
@@ -355,17 +882,28 @@ void RvPipelineCpu::stage_exec()
             decode_cycle = 2;
             fetch_cycle = std::max<uint64_t>(fetch_cycle, 1);
         }
-        return;
+        return std::nullopt;
     }
     if (!exec_inst) {
-        return;
+        return std::nullopt;
     }
-    if (dynamic_cast<RvFaultInst *>(exec_inst.get()))
-        return;
+    if (exec_inst->is_fault())
+        return std::nullopt;
     try {
-        exec_inst->exec(exec_reg);
+        auto result{ exec_inst->exec(exec_reg) };
+        // Syscalls are not emulated by the pipeline
+        if (result.trap == RvExecResult::T_ECALL)
+            throw RvSysCall{};
+        if (result.mem_acc) {
+            mem_acc_info = result.mem_acc;
+            return std::nullopt;
+        }
+        if (result.next_pc != exec_reg.pc + 4) {
+            exec_cycle = 0;
+            return result.next_pc;
+        }
         exec_cycle = exec_inst->exec_cycle() - 1;
-        if (exec_cycle == 39 && ((exec_inst && exec_inst->div_rem_ok(decode_inst.get())) || (mem_inst && mem_inst->div_rem_ok(exec_inst.get()))))
+        if (exec_cycle == 39 && ((exec_inst && exec_inst->div_rem_ok(decode_inst)) || (mem_inst && mem_inst->div_rem_ok(exec_inst))))
             exec_cycle = 19;
         if (exec_cycle > 0) {
             decode_cycle = 2;
@@ -373,20 +911,14 @@ void RvPipelineCpu::stage_exec()
         }
     }
     catch (const RvIllIns &) {
-        exec_inst.reset(new RvIllFInst);
-    }
-    catch (const RvMemAcc &info) {
-        mem_acc_info = info;
-    }
-    catch (const RvCtrlFlowJmp &info) {
-        exec_cycle = 0;
-        throw;
+        exec_inst = RvDecodedInst::fault(RvOp::ILLEGAL);
     }
+    return std::nullopt;
 }
 
 void RvPipelineCpu::stage_mem()
 {
-    if (mem_inst && mem_inst->data_hazard(decode_inst.get()) == RvInst::H_RAW) {
+    if (mem_inst && mem_inst->data_hazard(decode_inst) == RvDecodedInst::H_RAW) {
         decode_cycle = 2;
         fetch_cycle = std::max<uint64_t>(fetch_cycle, 1);
     }
@@ -413,14 +945,14 @@ void RvPipelineCpu::stage_mem()
         mem_acc_info = std::nullopt;
     }
     catch(RvAccVio &) {
-        mem_inst.reset(new RvMemFInst);
+        mem_inst = RvDecodedInst::fault(RvOp::MEM_FAULT);
         mem_acc_info = std::nullopt;
     }
 }
 
 void RvPipelineCpu::stage_wb()
 {
-    if (wb_inst && wb_inst->data_hazard(decode_inst.get()) == RvInst::H_RAW) {
+    if (wb_inst && wb_inst->data_hazard(decode_inst) == RvDecodedInst::H_RAW) {
         decode_cycle = 2;
         fetch_cycle = std::max<uint64_t>(fetch_cycle, 1);
     }
@@ -501,15 +1033,12 @@ void RvPipelineCpu::step() try
     decode_cycle = std::max<uint64_t>(1, decode_cycle);
     stage_wb();
     stage_mem();
-    if (auto tmp_ptr{ dynamic_cast<RvSBInst *>(exec_inst.get()) }) {
+    if (exec_inst && exec_inst->is_branch()) {
         bool taken{ false };
         uint64_t real_pc{ exec_reg.pc + 4 };
         branch_insts++;
-        try {
-            stage_exec();
-        }
-        catch (const RvCtrlFlowJmp &info) {
-            real_pc = info.target_addr;
+        if (auto target{ stage_exec() }) {
+            real_pc = *target;
             taken = true;
         }
         predictor->update(exec_reg.pc, taken);
@@ -526,16 +1055,13 @@ void RvPipelineCpu::step() try
         }
     }
     else {
-        try {
-            stage_exec();
-        }
-        catch (const RvCtrlFlowJmp &info) {
+        if (auto target{ stage_exec() }) {
             if (decode_inst)
                 squashed_insts++;
             decode_invd = true;
             exec_invd = true;
             squashed_insts++;
-            fetch_pc = info.target_addr;
+            fetch_pc = *target;
             fetch_cycle = 1;
             decode_cycle = 2;
         }
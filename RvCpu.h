@@ -1,16 +1,22 @@
 #pragma once
 
 #include <array>
+#include <chrono>
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include <set>
 #include <unordered_map>
 
 class RvReg;
+class RvDecodeCache;
 
 #include "RvMem.h"
 #include "RvInst.h"
 #include "RvBranchPred.hpp"
+#include "RvBlock.h"
+#include "RvJit.h"
+#include "RvCodeCache.h"
 
 constexpr const char *RVREGABINAME[32] = {
     "zero", "ra", "sp", "gp", "tp", "t0",
@@ -50,6 +56,8 @@ public:
 class RvBaseCpu {
 protected:
     std::set<uint64_t> breakpoint;
+    // Syscalls aren't emulated, dump registers instead
+    void report_syscall();
 public:
     RvMem &mem;
     RvReg reg;
@@ -74,12 +82,111 @@ public:
 };
 
 class RvSimpleCpu : public RvBaseCpu {
+    std::shared_ptr<RvDecodeCache> icache;
 public:
-    RvSimpleCpu(RvMem &mem, const RvReg &reg);
+    RvSimpleCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache = nullptr);
     void step() override;
     uint64_t exec(uint64_t cycle = 0, bool no_bp = false) override;
 };
 
+// Runs pre-decoded blocks with threaded dispatch and no per-inst trace.
+// Breakpoints and cycle budgets are checked at block boundaries only.
+class RvThreadedCpu : public RvBaseCpu {
+public:
+    // Where guest insts ran
+    enum tier_t {
+        T_INTERP = 0,
+        T_BLOCK = 1,
+        T_NATIVE = 2,
+        T_COUNT = 3,
+    };
+    struct tier_stat_t {
+        uint64_t insts;
+        std::chrono::nanoseconds time;
+    };
+protected:
+    std::shared_ptr<RvDecodeCache> icache;
+    RvBlockCache blocks;
+    RvBlockContext ctx;
+    // Block starts entered fewer times than this run inst by inst without
+    // building a block, 0 builds blocks right away
+    uint64_t build_threshold;
+    std::unordered_map<uint64_t, uint64_t> cold_entries;
+    // Linked blocks entered this often aren't run from other blocks, so
+    // subclasses see them in run_block
+    uint64_t hot_threshold;
+    // Insts run by fused pairs, counted when their blocks are left
+    uint64_t fused_insts;
+    std::array<tier_stat_t, T_COUNT> tier_stat;
+    void load_context();
+    void store_context();
+    // Run from the start of a block, following links while inst_exec stays
+    // within limit. Adds retired insts to inst_exec, returns the block it left from
+    virtual RvBlock *run_block(RvBlock &block, uint64_t &inst_exec, uint64_t limit);
+    // Called before block is dispatched, so its tier is settled before the
+    // run is timed. Nothing to do here
+    virtual void promote(RvBlock &) {}
+    // Called for each block taken from a code cache, nothing to do here
+    virtual void adopted(RvBlock &) {}
+public:
+    RvThreadedCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache = nullptr);
+    bool add_breakpoint(uint64_t addr) override;
+    bool remove_breakpoint(uint64_t addr) override;
+    void step() override;
+    uint64_t exec(uint64_t cycle = 0, bool no_bp = false) override;
+    uint64_t get_fused_count() const;
+    const std::array<tier_stat_t, T_COUNT> &get_tier_stat() const;
+    // Add blocks saved by an earlier run whose insts still match memory
+    void load_blocks(const RvCodeCache &cache);
+    // Save current blocks, false if the cache can't be written
+    bool save_blocks(RvCodeCache &cache);
+};
+
+// Translates hot blocks to host code, colder ones stay on the threaded interpreter
+class RvJitCpu : public RvThreadedCpu {
+public:
+    struct jit_stat_t {
+        uint64_t installed;
+        // Translations that failed or whose block was dropped meanwhile
+        uint64_t dropped;
+        // From queueing a block to installing its code
+        std::chrono::nanoseconds total_latency;
+        std::chrono::nanoseconds max_latency;
+        std::chrono::nanoseconds total_compile;
+        size_t max_depth;
+    };
+private:
+    RvJit jit;
+    // Declared after jit, so workers are stopped before the code cache goes
+    std::unique_ptr<RvJitCompiler> compiler;
+    jit_stat_t jit_stat;
+    // Install code finished by workers into its blocks
+    void install();
+    // Translate a hot block, or queue it if there are workers
+    void translate(RvBlock &block);
+protected:
+    RvBlock *run_block(RvBlock &block, uint64_t &inst_exec, uint64_t limit) override;
+    void promote(RvBlock &block) override;
+    void adopted(RvBlock &block) override;
+public:
+    // Default entries before a block is translated
+    static constexpr uint64_t HOT_THRESHOLD{ 16 };
+    // Default worker threads, 0 translates on the emulation thread
+    static constexpr size_t JIT_THREADS{ 1 };
+    RvJitCpu(RvMem &mem, const RvReg &reg, std::shared_ptr<RvDecodeCache> icache = nullptr, uint64_t jit_threshold = HOT_THRESHOLD, size_t jit_threads = JIT_THREADS);
+    uint64_t exec(uint64_t cycle = 0, bool no_bp = false) override;
+    const jit_stat_t &get_jit_stat() const;
+};
+
+// Starts code in the plain interpreter, promotes block starts entered
+// build_threshold times to pre-decoded blocks, and blocks entered
+// jit_threshold times to host code
+class RvTieredCpu : public RvJitCpu {
+public:
+    static constexpr uint64_t BUILD_THRESHOLD{ 2 };
+    RvTieredCpu(RvMem &mem, const RvReg &reg, uint64_t build_threshold = BUILD_THRESHOLD, uint64_t jit_threshold = HOT_THRESHOLD, size_t jit_threads = JIT_THREADS, std::shared_ptr<RvDecodeCache> icache = nullptr);
+};
+
 class RvMultiCycleCpu : public RvBaseCpu {
     uint64_t executed_cycles;
     uint64_t executed_insts;
@@ -112,12 +219,12 @@ class RvPipelineCpu : public RvBaseCpu{
     std::shared_ptr<RvBranchPred> predictor;
 
     // Stages instructions
-    std::unique_ptr<RvInst> fetch_inst;
-    std::unique_ptr<RvInst> decode_inst;
-    std::unique_ptr<RvInst> exec_inst;
-    std::unique_ptr<RvInst> exec_mul_inst;
-    std::unique_ptr<RvInst> mem_inst;
-    std::unique_ptr<RvInst> wb_inst;
+    std::optional<RvDecodedInst> fetch_inst;
+    std::optional<RvDecodedInst> decode_inst;
+    std::optional<RvDecodedInst> exec_inst;
+    std::optional<RvDecodedInst> exec_mul_inst;
+    std::optional<RvDecodedInst> mem_inst;
+    std::optional<RvDecodedInst> wb_inst;
 
     // Stages stall
     uint64_t fetch_cycle;
@@ -145,7 +252,8 @@ class RvPipelineCpu : public RvBaseCpu{
     // Stages operation
     void stage_fetch();
     void stage_decode();
-    void stage_exec();
+    // returns redirected fetch pc if control flow changed
+    std::optional<uint64_t> stage_exec();
     void stage_mem();
     void stage_wb();
 public:
@@ -0,0 +1,85 @@
+#include "RvDecodeCache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+RvDecodeCache::RvDecodeCache(RvMem &mem)
+    : mem{ mem }
+    , straddler{}
+{
+    return;
+}
+
+const RvDecodedInst &RvDecodeCache::fetch(uint64_t pc)
+{
+    if (pc & 1)
+        throw RvMisAlign(pc);
+    if ((pc & 0xfff) > 0x1000 - sizeof(uint32_t)) [[unlikely]] {
+        straddler = RvDecodedInst::decode(mem.fetch(pc));
+        return straddler;
+    }
+    auto gen{ mem.generation(pc) };
+    auto &page{ pages[pc >> 12] };
+    if (!page || page->gen != gen) {
+        page.reset(new page_t{});
+        page->gen = gen;
+    }
+    auto &slot{ page->insts[(pc & 0xfff) >> 1] };
+    if (!slot.handler)
+        slot = RvDecodedInst::decode(mem.fetch(pc));
+    return slot;
+}
+
+size_t RvDecodeCache::predecode(uint64_t start, uint64_t end, size_t threads)
+{
+    // Pages are created here, so workers only fill slots of their own pages
+    // and read guest memory straight from the host, leaving RvMem untouched
+    std::vector<std::pair<const char *, page_t *>> todo;
+    for (auto addr{ start & ~0xfffull }; addr < end; addr += 1 << 12) {
+        uint64_t gen;
+        try {
+            gen = mem.generation(addr);
+        }
+        catch (const RvAccVio &) {
+            continue;
+        }
+        auto &page{ pages[addr >> 12] };
+        if (!page || page->gen != gen) {
+            page.reset(new page_t{});
+            page->gen = gen;
+        }
+        todo.emplace_back(static_cast<const char *>(mem.host_page(addr).first), page.get());
+    }
+    threads = std::clamp<size_t>(threads, 1, std::max<size_t>(todo.size(), 1));
+    auto decode{ [&](size_t first, size_t last) {
+        for (auto i{ first }; i < last; i++) {
+            auto [host, page] { todo[i] };
+            for (size_t offset{ 0 }; offset < 1 << 12; offset += 4)
+                if (!page->insts[offset >> 1].handler) {
+                    uint32_t raw;
+                    std::memcpy(&raw, host + offset, sizeof(raw));
+                    page->insts[offset >> 1] = RvDecodedInst::decode(raw);
+                }
+        }
+    } };
+    std::vector<std::thread> workers;
+    auto chunk{ (todo.size() + threads - 1) / threads };
+    for (size_t first{ chunk }; first < todo.size(); first += chunk)
+        workers.emplace_back(decode, first, std::min(first + chunk, todo.size()));
+    decode(0, std::min(chunk, todo.size()));
+    for (auto &worker : workers)
+        worker.join();
+    return todo.size() * ((1 << 12) / 4);
+}
+
+void RvDecodeCache::invalidate(uint64_t addr)
+{
+    pages.erase(addr >> 12);
+}
+
+void RvDecodeCache::clear()
+{
+    pages.clear();
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "RvInst.h"
+#include "RvMem.h"
+
+// Decoded instructions of executed pages, keyed by guest PC.
+// Pages are decoded lazily and dropped when RvMem reports a new generation.
+class RvDecodeCache {
+    // PC is always aligned to 2
+    static constexpr size_t SLOTS{ (1 << 12) >> 1 };
+    struct page_t {
+        uint64_t gen;
+        // Slots not decoded yet have no handler
+        std::array<RvDecodedInst, SLOTS> insts;
+    };
+    RvMem &mem;
+    std::unordered_map<uint64_t, std::unique_ptr<page_t>> pages;
+    // Last inst fetched across a page end. It depends on two pages, so it's
+    // decoded again on every fetch instead of being cached with either
+    RvDecodedInst straddler;
+    RvDecodeCache(const RvDecodeCache &) = delete;
+    RvDecodeCache &operator=(const RvDecodeCache &) = delete;
+public:
+    RvDecodeCache(RvMem &mem);
+    // Get the decoded instruction at pc, throws like RvMem::fetch. The
+    // reference is valid until the next fetch only if pc crosses a page end
+    const RvDecodedInst &fetch(uint64_t pc);
+    // Decode every 4-byte slot of the executable pages in [start, end) now,
+    // pages are split across threads. Returns the slots of those pages
+    size_t predecode(uint64_t start, uint64_t end, size_t threads);
+    // Drop the page containing addr
+    void invalidate(uint64_t addr);
+    void clear();
+};
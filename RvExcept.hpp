@@ -40,10 +40,6 @@ public:
     RvSysCall() : RvException(0, "") {}
 };
 
-struct RvCtrlFlowJmp {
-    uint64_t target_addr;
-};
-
 struct RvMemAcc {
     uint64_t target_addr;
     size_t width;
@@ -0,0 +1,46 @@
+#include "RvImage.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RV_IMAGE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+RvImage::RvImage(char *base, size_t size)
+    : base{ base }
+    , size{ size }
+{
+    return;
+}
+
+std::shared_ptr<RvImage> RvImage::open(const std::string &path)
+{
+#ifdef RV_IMAGE_MMAP
+    int fd{ ::open(path.c_str(), O_RDONLY) };
+    if (fd < 0)
+        return nullptr;
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    std::shared_ptr<RvImage> image;
+    // Read only and clean, so the host shares it with other processes too
+    void *addr{ ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) };
+    if (addr != MAP_FAILED)
+        image.reset(new RvImage(static_cast<char *>(addr), st.st_size));
+    ::close(fd);
+    return image;
+#else
+    return nullptr;
+#endif
+}
+
+RvImage::~RvImage()
+{
+#ifdef RV_IMAGE_MMAP
+    ::munmap(base, size);
+#endif
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// An ELF file mapped read only for one guest. The guest maps its pages
+// directly, writable ones copy-on-write through RvMem. The mapping stays
+// clean, so the host page cache backs the text of every emulator process
+// running the same file with the same frames.
+class RvImage {
+    char *base;
+    size_t size;
+    RvImage(char *base, size_t size);
+    RvImage(const RvImage &) = delete;
+    RvImage &operator=(const RvImage &) = delete;
+public:
+    // Map the file at path, nullptr if it can't be mapped
+    static std::shared_ptr<RvImage> open(const std::string &path);
+    const char *data() const { return base; }
+    size_t length() const { return size; }
+    ~RvImage();
+};
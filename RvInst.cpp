@@ -1,12 +1,12 @@
 #include "RvInst.h"
+#include "RvCpu.h"
 
-#include <unordered_map>
-#include <functional>
-#include <bit>
+#include <array>
+#include <type_traits>
+#include <utility>
 
 #include "RvExcept.hpp"
-
-using namespace std::string_literals;
+#include "RvOpTable.hpp"
 
 constexpr uint8_t get_opcode(uint32_t inst) {
     return inst & 0b1111111;
@@ -47,564 +47,45 @@ constexpr int64_t get_uj_imm(uint32_t inst) {
     return result | ((inst & 0x7fe00000) >> 20) | ((inst & 0x00100000) >> 9) | (inst & 0x0000ff000);
 }
 
-RvInst *RvInst::decode(uint32_t inst) {
-    switch (inst & 0b1111111) {
-    case 0x33:
-        // R-type 64-bit arithmetic
-    case 0x3b:
-        // R-type 32-bit arithmetic
-        return new RvRInst(inst);
-    case 0x03:
-        // I-type load insts
-    case 0x13:
-        // I-type 64-bit immediate arithmetic
-    case 0x1b:
-        // I-type 32-bit immediate arithmetic
-    case 0x67:
-        // I-type jump and link register
-    case 0x73:
-        // I-type transfer control to kernel
-        return new RvIInst(inst);
-    case 0x23:
-        // S-type store insts
-        return new RvSInst(inst);
-    case 0x63:
-        // SB-type branch insts
-        return new RvSBInst(inst);
-    case 0x17:
-        // U-type add upper immediate to PC
-    case 0x37:
-        // U-type load upper immediate
-        return new RvUInst(inst);
-    case 0x6f:
-        // UJ-type jump far
-        return new RvUJInst(inst);
-    default:
-        return new RvIllFInst{};
-    }
-}
-
-void RvInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const
+// Per-format op lookups, nullptr if the encoding is illegal
+const RvRInstOp *find_r_op(uint32_t inst)
 {
-    return;
+    auto f7{ funct7_index(get_funct7(inst)) };
+    if (f7 < 0)
+        return nullptr;
+    auto &op{ RvRInstOpTable[get_opcode(inst) == 0x3b][get_funct3(inst)][f7] };
+    return op.name ? &op : nullptr;
 }
 
-RvInst::hazard_t RvInst::data_hazard(RvInst *subsequent_inst)
+const RvIInstOp *find_i_op(uint32_t inst)
 {
-    if (!subsequent_inst)
-        return H_NOHAZARD;
-    /*
-    RvReg tmp_reg{};
-    std::optional<RvMemAcc> this_inst;
-    std::optional<RvMemAcc> subs_inst;
-    try {
-        this->exec(tmp_reg);
-    }
-    catch (const RvMemAcc &meminfo) {
-        this_inst = meminfo;
-    }
-    catch (const RvCtrlFlowJmp &) {
-        ;
-    }
-    catch (const RvException &) {
-        return H_NOHAZARD;
-    }
-    try {
-        subsequent_inst->exec(tmp_reg);
-    }
-    catch (const RvMemAcc &meminfo) {
-        subs_inst = meminfo;
-    }
-    catch (const RvCtrlFlowJmp &) {
-        ;
-    }
-    catch (const RvException &) {
-        return H_NOHAZARD;
-    }
-    if (this_inst && subs_inst && this_inst->target_addr == subs_inst->target_addr) {
-        if (this_inst->rw == RvMemAcc::WRITE && subs_inst->rw == RvMemAcc::READ) {
-            return H_RAW;
-        }
-        else if (this_inst->rw == RvMemAcc::READ && subs_inst->rw == RvMemAcc::WRITE) {
-            return H_WAR;
-        }
-        else if (this_inst->rw == RvMemAcc::WRITE && subs_inst->rw == RvMemAcc::WRITE) {
-            return H_WAW;
-        }
-    }
-    */
-
-    std::optional<uint8_t> this_rs1;
-    std::optional<uint8_t> this_rs2;
-    std::optional<uint8_t> this_rd;
-    std::optional<uint8_t> subs_rs1;
-    std::optional<uint8_t> subs_rs2;
-    std::optional<uint8_t> subs_rd;
-
-    // Get this regs
-    if (auto ptr{ dynamic_cast<RvRInst *>(this) }) {
-        this_rs1 = ptr->rs1;
-        this_rs2 = ptr->rs2;
-        if (ptr->rd)
-            this_rd = ptr->rd;
-    }
-    else if (auto ptr{ dynamic_cast<RvIInst *>(this) }) {
-        this_rs1 = ptr->rs1;
-        if (ptr->rd)
-            this_rd = ptr->rd;
-    }
-    else if (auto ptr{ dynamic_cast<RvSInst *>(this) }) {
-        this_rs1 = ptr->rs1;
-        this_rs2 = ptr->rs2;
-    }
-    else if (auto ptr{ dynamic_cast<RvSBInst *>(this) }) {
-        this_rs1 = ptr->rs1;
-        this_rs2 = ptr->rs2;
-    }
-    else if (auto ptr{ dynamic_cast<RvUInst *>(this) }) {
-        if (ptr->rd)
-            this_rd = ptr->rd;
-    }
-    else if (auto ptr{ dynamic_cast<RvUJInst *>(this) }) {
-        if (ptr->rd)
-            this_rd = ptr->rd;
-    }
-
-    // Get subsequent inst regs
-    if (auto ptr{ dynamic_cast<RvRInst *>(subsequent_inst) }) {
-        subs_rs1 = ptr->rs1;
-        subs_rs2 = ptr->rs2;
-        if (ptr->rd)
-            subs_rd = ptr->rd;
-    }
-    else if (auto ptr{ dynamic_cast<RvIInst *>(subsequent_inst) }) {
-        subs_rs1 = ptr->rs1;
-        if (ptr->rd)
-            subs_rd = ptr->rd;
-    }
-    else if (auto ptr{ dynamic_cast<RvSInst *>(subsequent_inst) }) {
-        subs_rs1 = ptr->rs1;
-        subs_rs2 = ptr->rs2;
-    }
-    else if (auto ptr{ dynamic_cast<RvSBInst *>(subsequent_inst) }) {
-        subs_rs1 = ptr->rs1;
-        subs_rs2 = ptr->rs2;
-    }
-    else if (auto ptr{ dynamic_cast<RvUInst *>(subsequent_inst) }) {
-        if (ptr->rd)
-            subs_rd = ptr->rd;
+    auto opcode{ get_opcode(inst) };
+    auto funct3{ get_funct3(inst) };
+    const RvIInstOp *op{};
+    if (i_has_funct7(opcode, funct3)) {
+        auto f7{ funct7_index(get_funct7(inst) & 0b1111110) };
+        if (f7 < 0)
+            return nullptr;
+        op = &RvIInstWithF7OpTable[opcode == 0x1B][funct3][f7];
     }
-    else if (auto ptr{ dynamic_cast<RvUJInst *>(subsequent_inst) }) {
-        if (ptr->rd)
-            subs_rd = ptr->rd;
+    else {
+        auto index{ i_opcode_index(opcode) };
+        if (index < 0)
+            return nullptr;
+        op = &RvIInstOpTable[index][funct3];
     }
-    if (this_rd && (this_rd == subs_rs1 || this_rd == subs_rs2))
-        return H_RAW;
-    else if ((this_rs1 && this_rs1 == subs_rd) || (this_rs2 && this_rs2 == subs_rd))
-        return H_WAR;
-    else if (this_rd && this_rd == subs_rd)
-        return H_WAW;
-    return H_NOHAZARD;
+    return op->name ? op : nullptr;
 }
 
-bool RvInst::div_rem_ok(RvInst *subsequent_inst) {
-    return false;
-}
-
-uint64_t RvInst::exec_cycle()
+const RvSBInstOp *find_sb_op(uint32_t inst)
 {
-    return 1;
-}
-
-#pragma region RvRInst
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::string>>> RvRInstNameDict{
-    { 0x33, {
-        { 0x00, {
-            { 0x00, "add" },
-            { 0x01, "mul" },
-            { 0x20, "sub" }
-        } },
-        { 0x01, {
-            { 0x00, "sll" },
-            { 0x01, "mulh" }
-        } },
-        { 0x02, {
-            { 0x00, "slt" },
-        } },
-        { 0x03, {
-            { 0x00, "sltu" },
-        } },
-        { 0x04, {
-            { 0x00, "xor" },
-            { 0x01, "div" }
-        } },
-        { 0x05, {
-            { 0x00, "srl" },
-            { 0x01, "divu" },
-            { 0x20, "sra" }
-        } },
-        { 0x06, {
-            { 0x00, "or" },
-            { 0x01, "rem" },
-        } },
-        { 0x07, {
-            { 0x00, "and" },
-            { 0x01, "remu" }
-        } }
-    } },
-    { 0x3b, {
-        {0x00, {
-            { 0x00, "addw" },
-            { 0x01, "mulw" },
-            { 0x20, "subw" }
-        } },
-        {0x04, {
-            { 0x01, "divw" }
-        } },
-        {0x06, {
-            { 0x01, "remw" }
-        } }
-    } }
-};
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::unordered_map<uint8_t, uint64_t>>> RvRInstCycleDict{
-    { 0x33, {
-        { 0x00, {
-            { 0x00, 1 },
-            { 0x01, 2 },
-            { 0x20, 1 }
-        } },
-        { 0x01, {
-            { 0x00, 1 },
-            { 0x01, 2 }
-        } },
-        { 0x02, {
-            { 0x00, 1 },
-        } },
-        { 0x03, {
-            { 0x00, 1 },
-        } },
-        { 0x04, {
-            { 0x00, 1 },
-            { 0x01, 40 }
-        } },
-        { 0x05, {
-            { 0x00, 1 },
-            { 0x01, 40 },
-            { 0x20, 1 }
-        } },
-        { 0x06, {
-            { 0x00, 1 },
-            { 0x01, 40 },
-        } },
-        { 0x07, {
-            { 0x00, 1 },
-            { 0x01, 40 }
-        } }
-    } },
-    { 0x3b, {
-        {0x00, {
-            { 0x00, 1 },
-            { 0x01, 1 },
-            { 0x20, 1 }
-        } },
-        {0x04, {
-            { 0x01, 40 }
-        } },
-        {0x06, {
-            { 0x01, 40 }
-        } }
-    } }
-};
-
-#ifdef _MSC_VER
-#include <__msvc_int128.hpp>
-uint64_t imull(uint64_t s1, uint64_t s2) {
-    std::_Signed128 result = s1;
-    result *= s2;
-    return static_cast<uint64_t>(result);
-}
-uint64_t imulh(uint64_t s1, uint64_t s2) {
-    std::_Signed128 result = s1;
-    result *= s2;
-    result >>= 64;
-    return static_cast<uint64_t>(result);
-}
-#endif
-
-#ifdef __GNUC__
-uint64_t imull(uint64_t s1, uint64_t s2) {
-    __int128_t result = s1;
-    result *= s2;
-    return result;
+    auto &op{ RvSBInstOpTable[get_funct3(inst)] };
+    return op.name ? &op : nullptr;
 }
-uint64_t imulh(uint64_t s1, uint64_t s2) {
-    __int128_t result = s1;
-    result *= s2;
-    return result >> 64;
-}
-#endif
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::function<uint64_t(uint64_t, uint64_t)>>>> RvRInstExecDict{
-    { 0x33, {
-        { 0x00, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 + s2; } },
-            { 0x01, imull },
-            { 0x20, [](uint64_t s1, uint64_t s2) { return s1 - s2; } }
-        } },
-        { 0x01, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 << s2; } },
-            { 0x01, imulh }
-        } },
-        { 0x02, {
-            { 0x00, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) < std::bit_cast<int64_t>(s2) ? 1 : 0; } },
-        } },
-        { 0x03, {
-            { 0x00, [](uint64_t s1, uint64_t s2) -> uint64_t { return s1 < s2 ? 1 : 0; } },
-        } },
-        { 0x04, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 ^ s2; } },
-            { 0x01, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) / std::bit_cast<int64_t>(s2); } }
-        } },
-        { 0x05, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 >> s2; } },
-            { 0x01, [](uint64_t s1, uint64_t s2) { return s1 / s2; } },
-            { 0x20, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) >> std::bit_cast<int64_t>(s2); } }
-        } },
-        { 0x06, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 | s2; } },
-            { 0x01, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) % std::bit_cast<int64_t>(s2); } },
-        } },
-        { 0x07, {
-            { 0x00, [](uint64_t s1, uint64_t s2) { return s1 & s2; } },
-            { 0x01, [](uint64_t s1, uint64_t s2) { return s1 % s2; } }
-        } }
-    } },
-    { 0x3b, {
-        {0x00, {
-            { 0x00, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1 + s2)); } },
-            { 0x01, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) * static_cast<int32_t>(s2)); } },
-            { 0x20, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1 - s2)); } }
-        } },
-        {0x04, {
-            { 0x01, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) / static_cast<int32_t>(s2)); } }
-        } },
-        {0x06, {
-            { 0x01, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) % static_cast<int32_t>(s2)); } }
-        } }
-    } }
-};
 
-RvRInst::RvRInst(uint32_t inst)
-    : funct3{ get_funct3(inst) }
-    , funct7{ get_funct7(inst) }
-    , rs1{ get_rs1(inst) }
-    , rs2{ get_rs2(inst) }
-    , rd{ get_rd(inst) }
+// Memory stage of loads and stores
+void mem_load(RvReg &reg, RvMem &mem, const RvMemAcc &info, uint8_t rd)
 {
-    opcode = get_opcode(inst);
-    return;
-}
-
-std::string RvRInst::name() const {
-    return inst_name() + " " + RVREGABINAME[rd] + ", " + RVREGABINAME[rs1] + ", " + RVREGABINAME[rs2];
-}
-
-std::string RvRInst::inst_name() const {
-    std::string result{};
-    try {
-        result = RvRInstNameDict.at(opcode).at(funct3).at(funct7);
-    }
-    catch (std::out_of_range) {
-        result = "undefined"s;
-    }
-    return std::move(result);
-}
-
-void RvRInst::exec(RvReg &reg) const try {
-    reg.set(rd, RvRInstExecDict.at(opcode).at(funct3).at(funct7)(reg[rs1], reg[rs2]));
-}
-catch (std::out_of_range) {
-    throw RvIllIns(reg.pc);
-}
-
-void RvRInst::write_back(RvReg &src, RvReg &dest) const
-{
-    dest[rd] = src[rd];
-}
-
-RvInst *RvRInst::copy() const
-{
-    return new RvRInst{ *this };
-}
-
-bool RvRInst::div_rem_ok(RvInst *subsequent_inst)
-{
-    if ((this->inst_name() != "div"s || subsequent_inst->inst_name() != "rem"s) && (this->inst_name() != "divu"s || subsequent_inst->inst_name() != "remu"s))
-        return false;
-    auto other{ dynamic_cast<RvRInst *>(subsequent_inst) };
-    return this->rs1 == other->rs1 && this->rs2 == other->rs2 && this->rd != other->rs1 && this->rd != other->rs2;
-}
-
-uint64_t RvRInst::exec_cycle()
-{
-    return RvRInstCycleDict.at(opcode).at(funct3).at(funct7);
-}
-
-#pragma endregion
-
-#pragma region RvIInst
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::string>>> RvIInstWithF7NameDict{
-    { 0x13, {
-        { 0x01, {
-            { 0x00, "slli" }
-        } },
-        { 0x05, {
-            { 0x00, "srli" },
-            { 0x20, "srai" }
-        } },
-    } }, 
-    { 0x1B, {
-        { 0x01, {
-            { 0x00, "slliw" }
-        } },
-        { 0x05, {
-            { 0x00, "srliw" },
-            { 0x20, "sraiw" }
-        } }
-    } }
-};
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::function<uint64_t(int64_t, int64_t)>>>> RvIInstWithF7ExecDict{
-    { 0x13, {
-        { 0x01, {
-            { 0x00, [](int64_t s, int64_t imm) -> uint64_t { return s << imm; } }
-        } },
-        { 0x05, {
-            { 0x00, [](int64_t s, int64_t imm) { return std::bit_cast<uint64_t>(s) >> imm; } },
-            { 0x20, [](int64_t s, int64_t imm) -> uint64_t { return s >> imm; } }
-        } },
-    } },
-    { 0x1B, {
-        { 0x01, {
-            { 0x00, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s) << static_cast<int32_t>(imm)); } }
-        } },
-        { 0x05, {
-            { 0x00, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(static_cast<uint32_t>(s) >> static_cast<uint32_t>(imm))); } },
-            { 0x20, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s) >> static_cast<int32_t>(imm)); } }
-        } }
-    } }
-};
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::string>> RvIInstNameDict{
-    { 0x03, {
-        { 0x00, "lb" },
-        { 0x01, "lh" },
-        { 0x02, "lw" },
-        { 0x03, "ld" },
-        { 0x04, "lbu" },
-        { 0x05, "lhu" },
-        { 0x06, "lwu" }
-    } },
-    { 0x13, {
-        { 0x00, "addi" },
-        { 0x02, "slti" },
-        { 0x04, "xori" },
-        { 0x06, "ori" },
-        { 0x07, "andi" }
-    } },
-    { 0x1B, {
-        { 0x00, "addiw" }
-    } },
-    { 0x67, {
-        { 0x00, "jalr" }
-    } },
-    { 0x73, {
-        { 0x00, "ecall"}
-    } }
-};
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::function<uint64_t(int64_t, int64_t)>>> RvIInstExecDict{
-    { 0x03, {
-        { 0x00, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 1, true, RvMemAcc::READ}; } },
-        { 0x01, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 2, true, RvMemAcc::READ}; } },
-        { 0x02, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 4, true, RvMemAcc::READ}; } },
-        { 0x03, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 8, true, RvMemAcc::READ}; } },
-        { 0x04, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 1, false, RvMemAcc::READ}; } },
-        { 0x05, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 2, false, RvMemAcc::READ}; } },
-        { 0x06, [](int64_t s, int64_t imm) -> uint64_t { throw RvMemAcc{std::bit_cast<uint64_t>(s + imm), 4, false, RvMemAcc::READ}; } }
-    } },
-    { 0x13, {
-        { 0x00, [](int64_t s, int64_t imm) -> uint64_t { return s + imm; } },
-        { 0x02, [](int64_t s, int64_t imm) -> uint64_t { return s < imm ? 1 : 0; } },
-        { 0x04, [](int64_t s, int64_t imm) -> uint64_t { return s ^ imm; } },
-        { 0x06, [](int64_t s, int64_t imm) -> uint64_t { return s | imm; } },
-        { 0x07, [](int64_t s, int64_t imm) -> uint64_t { return s & imm; } }
-    } },
-    { 0x1B, {
-        { 0x00, [](int64_t s, int64_t imm) -> uint64_t { return ((s + imm) << 32) >> 32; } }
-    } },
-    { 0x67, {
-        { 0x00, [](int64_t s, int64_t imm) -> uint64_t { throw RvCtrlFlowJmp{ std::bit_cast<uint64_t>(s + imm) }; }}
-    } },
-    { 0x73, {
-        {0x00, [](int64_t, int64_t) -> uint64_t { throw RvSysCall{}; } }
-    } }
-};
-
-RvIInst::RvIInst(uint32_t inst)
-    : funct3{ get_funct3(inst) }
-    , rs1{ get_rs1(inst) }
-    , rd{ get_rd(inst) }
-{
-    opcode = get_opcode(inst);
-    try {
-        void(RvIInstWithF7NameDict.at(opcode).at(funct3));
-        funct7 = get_funct7(inst) & 0b1111110;
-        imm = get_i_imm(inst) & 0b111111;
-    }
-    catch (std::out_of_range) {
-        funct7 = std::nullopt;
-        imm = get_i_imm(inst);
-    }
-    return;
-}
-
-std::string RvIInst::name() const
-{
-    return inst_name() + " " + RVREGABINAME[rd] + ", " + RVREGABINAME[rs1] + ", " + std::to_string(imm);
-}
-
-std::string RvIInst::inst_name() const
-{
-    std::string result{};
-    try {
-        if (funct7) {
-            result = RvIInstWithF7NameDict.at(opcode).at(funct3).at(funct7.value());
-        }
-        else {
-            result = RvIInstNameDict.at(opcode).at(funct3);
-        }
-    }
-    catch (std::out_of_range) {
-        result = "undefined";
-    }
-    return std::move(result);
-}
-
-void RvIInst::exec(RvReg &reg) const try {
-    if (funct7)
-        reg.set(rd, RvIInstWithF7ExecDict.at(opcode).at(funct3).at(funct7.value())(reg[rs1], imm));
-    else
-        reg.set(rd, RvIInstExecDict.at(opcode).at(funct3)(reg[rs1], imm));
-}
-catch (std::out_of_range) {
-    throw RvIllIns(reg.pc);
-}
-
-void RvIInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const {
     if (info.rw != info.READ)
         throw __LINE__;
     switch (info.width) {
@@ -637,68 +118,7 @@ void RvIInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const {
     }
 }
 
-void RvIInst::write_back(RvReg &src, RvReg &dest) const
-{
-    dest[rd] = src[rd];
-}
-
-RvInst *RvIInst::copy() const
-{
-    return new RvIInst{ *this };
-}
-
-#pragma endregion
-
-#pragma region RvSInst
-
-RvSInst::RvSInst(uint32_t inst)
-    : rs1(get_rs1(inst))
-    , rs2(get_rs2(inst))
-    , funct3(get_funct3(inst))
-    , imm(get_s_imm(inst))
-{
-    opcode = get_opcode(inst);
-    return;
-}
-
-std::string RvSInst::name() const
-{
-    return inst_name() + " " + RVREGABINAME[rs2] + ", " + std::to_string(imm) + "(" + RVREGABINAME[rs1] + ")";
-}
-
-std::string RvSInst::inst_name() const
-{
-    switch (funct3) {
-    case 0x00:
-        return "sb"s;
-    case 0x01:
-        return "sh"s;
-    case 0x02:
-        return "sw"s;
-    case 0x03:
-        return "sd"s;
-    default:
-        return "undefined"s;
-    }
-}
-
-void RvSInst::exec(RvReg &reg) const
-{
-    switch (funct3) {
-    case 0x00:
-        throw RvMemAcc{ reg[rs1] + imm, 1, false, RvMemAcc::WRITE };
-    case 0x01:
-        throw RvMemAcc{ reg[rs1] + imm, 2, false, RvMemAcc::WRITE };
-    case 0x02:
-        throw RvMemAcc{ reg[rs1] + imm, 4, false, RvMemAcc::WRITE };
-    case 0x03:
-        throw RvMemAcc{ reg[rs1] + imm, 8, false, RvMemAcc::WRITE };
-    default:
-        throw RvIllIns(reg.pc);
-    }
-}
-
-void RvSInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const
+void mem_store(RvReg &reg, RvMem &mem, const RvMemAcc &info, uint8_t rs2)
 {
     if (info.rw != info.WRITE)
         throw __LINE__;
@@ -721,249 +141,294 @@ void RvSInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const
             throw RvMisAlign(info.target_addr);
         mem[info.target_addr] = static_cast<uint64_t>(reg[rs2]);
         break;
-    default :
+    default:
         throw __LINE__;
     }
 }
 
-void RvSInst::write_back(RvReg &src, RvReg &dest) const
-{
-    return;
-}
+#pragma region RvDecodedInst
 
-RvInst *RvSInst::copy() const
+template <RvOp op>
+RvExecResult exec_r(const RvDecodedInst &inst, RvReg &reg)
 {
-    return new RvSInst{ *this };
+    constexpr auto fn{ r_entry(op).fn };
+    reg.set(inst.rd, fn(reg[inst.rs1], reg[inst.rs2]));
+    return { reg.pc + 4 };
 }
 
-#pragma endregion
-
-#pragma region RvSBInst
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::string>> RvSBInstNameDict{
-    { 0x63, {
-        { 0x00, "beq" },
-        { 0x01, "bne" },
-        { 0x04, "blt" },
-        { 0x05, "bge" },
-        { 0x06, "bltu" },
-        { 0x07, "bgeu" }
-    } }
-};
-
-std::unordered_map<uint8_t, std::unordered_map<uint8_t, std::function<void(int64_t, int64_t, int64_t, uint64_t)>>> RvSBInstExecDict{
-    { 0x63, {
-        { 0x00, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (s1 == s2) throw RvCtrlFlowJmp{pc + imm}; } },
-        { 0x01, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (s1 != s2) throw RvCtrlFlowJmp{pc + imm}; } },
-        { 0x04, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (s1 < s2) throw RvCtrlFlowJmp{pc + imm}; } },
-        { 0x05, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (s1 >= s2) throw RvCtrlFlowJmp{pc + imm}; } },
-        { 0x06, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (std::bit_cast<uint64_t>(s1) < std::bit_cast<uint64_t>(s2)) throw RvCtrlFlowJmp{pc + imm}; } },
-        { 0x07, [](int64_t s1, int64_t s2, int64_t imm, uint64_t pc) {if (std::bit_cast<uint64_t>(s1) >= std::bit_cast<uint64_t>(s2)) throw RvCtrlFlowJmp{pc + imm}; } }
-    } }
-};
-
-RvSBInst::RvSBInst(uint32_t inst)
-    : imm(get_sb_imm(inst))
-    , funct3(get_funct3(inst))
-    , rs1(get_rs1(inst))
-    , rs2(get_rs2(inst))
-{
-    opcode = get_opcode(inst);
-    return;
-}
-
-std::string RvSBInst::name() const
-{
-    return inst_name() + " " + RVREGABINAME[rs1] + ", " + RVREGABINAME[rs2] + ", " + std::to_string(imm);
-}
-
-std::string RvSBInst::inst_name() const
+template <RvOp op>
+RvExecResult exec_i(const RvDecodedInst &inst, RvReg &reg)
 {
-    std::string result{};
-    try {
-        result = RvSBInstNameDict.at(opcode).at(funct3);
-    }
-    catch (std::out_of_range) {
-        result = "undefined"s;
-    }
-    return std::move(result);
-}
-
-void RvSBInst::exec(RvReg &reg) const try {
-    RvSBInstExecDict.at(opcode).at(funct3)(reg[rs1], reg[rs2], imm, reg.pc);
-}
-catch (std::out_of_range) {
-    throw RvIllIns(reg.pc);
+    constexpr auto fn{ i_entry(op).fn };
+    reg.set(inst.rd, fn(reg[inst.rs1], inst.imm));
+    return { reg.pc + 4 };
 }
 
-void RvSBInst::write_back(RvReg &src, RvReg &dest) const
+template <RvOp op>
+RvExecResult exec_load(const RvDecodedInst &inst, RvReg &reg)
 {
-    return;
+    constexpr auto &entry{ i_entry(op) };
+    return { reg.pc + 4, RvMemAcc{ reg[inst.rs1] + inst.imm, entry.width, entry.sign, RvMemAcc::READ } };
 }
 
-RvInst *RvSBInst::copy() const
+template <RvOp op>
+RvExecResult exec_store(const RvDecodedInst &inst, RvReg &reg)
 {
-    return new RvSBInst{ *this };
+    constexpr size_t width{ size_t{ 1 } << (static_cast<size_t>(op) - static_cast<size_t>(RvOp::SB)) };
+    return { reg.pc + 4, RvMemAcc{ reg[inst.rs1] + inst.imm, width, false, RvMemAcc::WRITE } };
 }
 
-uint64_t RvSBInst::get_target(uint64_t pc) const
+template <RvOp op>
+RvExecResult exec_branch(const RvDecodedInst &inst, RvReg &reg)
 {
-    return pc + imm;
+    constexpr auto fn{ sb_entry(op).fn };
+    if (fn(reg[inst.rs1], reg[inst.rs2]))
+        return { inst.get_target(reg.pc) };
+    return { reg.pc + 4 };
 }
 
-#pragma endregion
-
-#pragma region RvUInst
-
-RvUInst::RvUInst(uint32_t inst)
-    : imm(get_u_imm(inst))
-    , rd(get_rd(inst))
+RvExecResult exec_jalr(const RvDecodedInst &inst, RvReg &reg)
 {
-    opcode = get_opcode(inst);
-    return;
+    // rd may be rs1
+    uint64_t target{ reg[inst.rs1] + inst.imm };
+    reg.set(inst.rd, reg.pc + 4);
+    return { target };
 }
 
-std::string RvUInst::name() const
+RvExecResult exec_ecall(const RvDecodedInst &inst, RvReg &reg)
 {
-    return inst_name() + " " + RVREGABINAME[rd] + ", " + std::to_string(imm);
+    return { reg.pc + 4, std::nullopt, RvExecResult::T_ECALL };
 }
 
-std::string RvUInst::inst_name() const
+RvExecResult exec_auipc(const RvDecodedInst &inst, RvReg &reg)
 {
-    std::string result{};
-    switch (opcode) {
-    case 0x17:
-        result = "auipc";
-        break;
-    case 0x37:
-        result = "lui"s;
-        break;
-    default:
-        result = "undefined"s;
-    }
-    return std::move(result);
+    reg.set(inst.rd, reg.pc + inst.imm);
+    return { reg.pc + 4 };
 }
 
-void RvUInst::exec(RvReg &reg) const
+RvExecResult exec_lui(const RvDecodedInst &inst, RvReg &reg)
 {
-    switch (opcode) {
-    case 0x17:
-        reg[rd] = reg.pc + imm;
-        break;
-    case 0x37:
-        reg[rd] = imm;
-        break;
-    default:
-        throw RvIllIns(reg.pc);
-    }
+    reg.set(inst.rd, inst.imm);
+    return { reg.pc + 4 };
 }
 
-void RvUInst::write_back(RvReg &src, RvReg &dest) const
+RvExecResult exec_jal(const RvDecodedInst &inst, RvReg &reg)
 {
-    dest[rd] = src[rd];
+    reg.set(inst.rd, reg.pc + 4);
+    return { reg.pc + inst.imm };
 }
 
-RvInst *RvUInst::copy() const
+RvExecResult exec_fence_i(const RvDecodedInst &inst, RvReg &reg)
 {
-    return new RvUInst{ *this };
+    // Decoded code is checked against RvMem generations before it runs again
+    return { reg.pc + 4 };
 }
 
-#pragma endregion
-
-#pragma region RvUJInst
-
-RvUJInst::RvUJInst(uint32_t inst)
-    : rd(get_rd(inst))
-    , imm(get_uj_imm(inst))
+RvExecResult exec_fault(const RvDecodedInst &inst, RvReg &reg)
 {
-    opcode = get_opcode(inst);
-    return;
+    throw RvIllIns(reg.pc);
 }
 
-std::string RvUJInst::name() const
-{
-    if (opcode == 0x6f)
-        return std::string{ "jal " } + RVREGABINAME[rd] + ", " + std::to_string(imm);
+template <RvOp op>
+constexpr RvDecodedInst::handler_t handler_of() {
+    if constexpr (op <= RvOp::REMW)
+        return exec_r<op>;
+    else if constexpr (op <= RvOp::SRAIW)
+        return exec_i<op>;
+    else if constexpr (op <= RvOp::LWU)
+        return exec_load<op>;
+    else if constexpr (op <= RvOp::SD)
+        return exec_store<op>;
+    else if constexpr (op <= RvOp::BGEU)
+        return exec_branch<op>;
+    else if constexpr (op == RvOp::JALR)
+        return exec_jalr;
+    else if constexpr (op == RvOp::ECALL)
+        return exec_ecall;
+    else if constexpr (op == RvOp::AUIPC)
+        return exec_auipc;
+    else if constexpr (op == RvOp::LUI)
+        return exec_lui;
+    else if constexpr (op == RvOp::JAL)
+        return exec_jal;
+    else if constexpr (op == RvOp::FENCE_I)
+        return exec_fence_i;
     else
-        return "undefined";
+        return exec_fault;
 }
 
-std::string RvUJInst::inst_name() const
-{
-    return opcode == 0x6f ? "jal"s : "undefined"s;
-}
+// Indexed by RvOp
+constexpr auto RvHandlerTable{ []<size_t... I>(std::index_sequence<I...>) {
+    return std::array<RvDecodedInst::handler_t, sizeof...(I)>{ handler_of<static_cast<RvOp>(I)>()... };
+}(std::make_index_sequence<static_cast<size_t>(RvOp::COUNT)>{}) };
 
-void RvUJInst::exec(RvReg &reg) const
-{
-    if (opcode == 0x6f) {
-        reg[rd] = reg.pc + 4;
-        throw RvCtrlFlowJmp{ reg.pc + imm };
-    }
-    else
-        throw RvIllIns(reg.pc);
-}
-
-void RvUJInst::write_back(RvReg &src, RvReg &dest) const
-{
-    dest[rd] = src[rd];
-}
+struct RvOpInfo {
+    const char *name;
+    uint64_t cycles;
+};
 
-RvInst *RvUJInst::copy() const
-{
-    return new RvUJInst{ *this };
+// Indexed by RvOp
+constexpr auto RvOpInfoTable{ [] {
+    std::array<RvOpInfo, static_cast<size_t>(RvOp::COUNT)> table{};
+    for (auto &op : RvRInstOpTable)
+        for (auto &f3 : op)
+            for (auto &entry : f3)
+                if (entry.name)
+                    table[static_cast<size_t>(entry.op)] = { entry.name, entry.cycles };
+    for (auto &op : RvIInstWithF7OpTable)
+        for (auto &f3 : op)
+            for (auto &entry : f3)
+                if (entry.name)
+                    table[static_cast<size_t>(entry.op)] = { entry.name, 1 };
+    for (auto &op : RvIInstOpTable)
+        for (auto &entry : op)
+            if (entry.name)
+                table[static_cast<size_t>(entry.op)] = { entry.name, 1 };
+    for (auto &entry : RvSBInstOpTable)
+        if (entry.name)
+            table[static_cast<size_t>(entry.op)] = { entry.name, 1 };
+    table[static_cast<size_t>(RvOp::SB)] = { "sb", 1 };
+    table[static_cast<size_t>(RvOp::SH)] = { "sh", 1 };
+    table[static_cast<size_t>(RvOp::SW)] = { "sw", 1 };
+    table[static_cast<size_t>(RvOp::SD)] = { "sd", 1 };
+    table[static_cast<size_t>(RvOp::AUIPC)] = { "auipc", 1 };
+    table[static_cast<size_t>(RvOp::LUI)] = { "lui", 1 };
+    table[static_cast<size_t>(RvOp::JAL)] = { "jal", 1 };
+    table[static_cast<size_t>(RvOp::FENCE_I)] = { "fence.i", 1 };
+    table[static_cast<size_t>(RvOp::ILLEGAL)] = { "Undefined opcode", 1 };
+    table[static_cast<size_t>(RvOp::MEM_FAULT)] = { "Memory Access violation", 1 };
+    return table;
+}() };
+
+static_assert(std::is_trivially_copyable_v<RvDecodedInst>);
+
+RvDecodedInst make_decoded(RvOp op, uint8_t rd = 0, uint8_t rs1 = 0, uint8_t rs2 = 0, int64_t imm = 0)
+{
+    return { RvHandlerTable[static_cast<size_t>(op)], imm, op, rd, rs1, rs2 };
+}
+
+RvDecodedInst RvDecodedInst::decode(uint32_t inst)
+{
+    auto opcode{ get_opcode(inst) };
+    switch (opcode) {
+    case 0x33:
+    case 0x3b:
+        if (auto op{ find_r_op(inst) })
+            return make_decoded(op->op, get_rd(inst), get_rs1(inst), get_rs2(inst));
+        break;
+    case 0x03:
+    case 0x13:
+    case 0x1b:
+    case 0x67:
+    case 0x73:
+        if (auto op{ find_i_op(inst) }) {
+            auto imm{ get_i_imm(inst) };
+            if (i_has_funct7(opcode, get_funct3(inst)))
+                imm &= 0b111111;
+            return make_decoded(op->op, get_rd(inst), get_rs1(inst), 0, imm);
+        }
+        break;
+    case 0x23:
+        if (get_funct3(inst) <= 0x03)
+            return make_decoded(static_cast<RvOp>(static_cast<uint8_t>(RvOp::SB) + get_funct3(inst)), 0, get_rs1(inst), get_rs2(inst), get_s_imm(inst));
+        break;
+    case 0x63:
+        if (auto op{ find_sb_op(inst) })
+            return make_decoded(op->op, 0, get_rs1(inst), get_rs2(inst), get_sb_imm(inst));
+        break;
+    case 0x17:
+        return make_decoded(RvOp::AUIPC, get_rd(inst), 0, 0, get_u_imm(inst));
+    case 0x37:
+        return make_decoded(RvOp::LUI, get_rd(inst), 0, 0, get_u_imm(inst));
+    case 0x6f:
+        return make_decoded(RvOp::JAL, get_rd(inst), 0, 0, get_uj_imm(inst));
+    case 0x0f:
+        // Only fence.i of MISC-MEM, its other fields are reserved
+        if (get_funct3(inst) == 0x01)
+            return make_decoded(RvOp::FENCE_I);
+        break;
+    }
+    return make_decoded(RvOp::ILLEGAL);
 }
 
-#pragma endregion
-
-void RvFaultInst::exec(RvReg &reg) const
+RvDecodedInst RvDecodedInst::fault(RvOp op)
 {
-    throw RvIllIns(0);
+    return make_decoded(op);
 }
 
-void RvFaultInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const
+RvDecodedInst RvDecodedInst::make(RvOp op, uint8_t rd, uint8_t rs1, uint8_t rs2, int64_t imm)
 {
-    throw RvIllIns(0);
+    if (op >= RvOp::COUNT)
+        return make_decoded(RvOp::ILLEGAL);
+    return make_decoded(op, rd, rs1, rs2, imm);
 }
 
-void RvFaultInst::write_back(RvReg &, RvReg &) const
+void RvDecodedInst::mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const
 {
-    throw RvHalt{};
+    if (is_fault())
+        throw RvIllIns(0);
+    if (info.rw == RvMemAcc::READ)
+        mem_load(reg, mem, info, rd);
+    else
+        mem_store(reg, mem, info, rs2);
 }
 
-#pragma region RvIllFInst
-
-std::string RvIllFInst::name() const
+void RvDecodedInst::write_back(RvReg &src, RvReg &dest) const
 {
-    return "Undefined opcode"s;
+    if (is_fault())
+        throw RvHalt{};
+    dest.set(rd, src[rd]);
 }
 
-std::string RvIllFInst::inst_name() const
+std::string RvDecodedInst::name() const
 {
-    return "Undefined opcode"s;
+    std::string result{ inst_name() };
+    if (op <= RvOp::REMW)
+        return result + " " + RVREGABINAME[rd] + ", " + RVREGABINAME[rs1] + ", " + RVREGABINAME[rs2];
+    else if (op <= RvOp::LWU || op == RvOp::JALR || op == RvOp::ECALL)
+        return result + " " + RVREGABINAME[rd] + ", " + RVREGABINAME[rs1] + ", " + std::to_string(imm);
+    else if (op <= RvOp::SD)
+        return result + " " + RVREGABINAME[rs2] + ", " + std::to_string(imm) + "(" + RVREGABINAME[rs1] + ")";
+    else if (op <= RvOp::BGEU)
+        return result + " " + RVREGABINAME[rs1] + ", " + RVREGABINAME[rs2] + ", " + std::to_string(imm);
+    else if (!is_fault() && op != RvOp::FENCE_I)
+        return result + " " + RVREGABINAME[rd] + ", " + std::to_string(imm);
+    return result;
 }
 
-RvInst *RvIllFInst::copy() const
+const char *RvDecodedInst::inst_name() const
 {
-    return new RvIllFInst{};
+    return RvOpInfoTable[static_cast<size_t>(op)].name;
 }
 
-#pragma endregion
-
-#pragma region RvMemFInst
-
-std::string RvMemFInst::name() const
+uint64_t RvDecodedInst::exec_cycle() const
 {
-    return "Memory Access Violation"s;
+    return RvOpInfoTable[static_cast<size_t>(op)].cycles;
 }
 
-std::string RvMemFInst::inst_name() const
+RvDecodedInst::hazard_t RvDecodedInst::data_hazard(const std::optional<RvDecodedInst> &subsequent_inst) const
 {
-    return "Memory Access violation"s;
+    if (!subsequent_inst)
+        return H_NOHAZARD;
+    // Unused register fields are 0, which never carries a hazard
+    auto &subs{ *subsequent_inst };
+    if (rd && (rd == subs.rs1 || rd == subs.rs2))
+        return H_RAW;
+    else if (subs.rd && (rs1 == subs.rd || rs2 == subs.rd))
+        return H_WAR;
+    else if (rd && rd == subs.rd)
+        return H_WAW;
+    return H_NOHAZARD;
 }
 
-RvInst *RvMemFInst::copy() const
+bool RvDecodedInst::div_rem_ok(const std::optional<RvDecodedInst> &subsequent_inst) const
 {
-    return new RvMemFInst{};
+    if (!subsequent_inst)
+        return false;
+    auto &other{ *subsequent_inst };
+    if ((op != RvOp::DIV || other.op != RvOp::REM) && (op != RvOp::DIVU || other.op != RvOp::REMU))
+        return false;
+    return rs1 == other.rs1 && rs2 == other.rs2 && rd != other.rs1 && rd != other.rs2;
 }
 
 #pragma endregion
@@ -1,178 +1,89 @@
 #pragma once
 
-#include <deque>
 #include <string>
 #include <cstdint>
 #include <optional>
 
-class RvInst;
+class RvReg;
 
-#include "RvCpu.h"
 #include "RvMem.h"
 #include "RvExcept.hpp"
 
-class RvInst {
-protected:
-    uint8_t opcode;
-    RvInst() = default;
-    RvInst(const RvInst &) = default;
-public:
+// What an instruction did in execute stage, memory access and traps are
+// carried out by the CPU model
+struct RvExecResult {
+    enum trap_t {
+        T_NONE = 0,
+        T_ECALL = 1,
+    };
+    uint64_t next_pc;
+    std::optional<RvMemAcc> mem_acc{};
+    trap_t trap{ T_NONE };
+};
+
+// Operations of RvDecodedInst, grouped by format
+enum class RvOp : uint8_t {
+    // R-type
+    ADD, MUL, SUB, SLL, MULH, SLT, SLTU, XOR, DIV, SRL, DIVU, SRA, OR, REM, AND, REMU,
+    ADDW, MULW, SUBW, DIVW, REMW,
+    // I-type arithmetic
+    ADDI, SLTI, XORI, ORI, ANDI, SLLI, SRLI, SRAI,
+    ADDIW, SLLIW, SRLIW, SRAIW,
+    // I-type loads
+    LB, LH, LW, LD, LBU, LHU, LWU,
+    // S-type stores
+    SB, SH, SW, SD,
+    // SB-type branches
+    BEQ, BNE, BLT, BGE, BLTU, BGEU,
+    // Others
+    JALR, ECALL, AUIPC, LUI, JAL,
+    // Zifencei, ends blocks so modified code is picked up right after it
+    FENCE_I,
+    // Faults
+    ILLEGAL, MEM_FAULT,
+    COUNT,
+    // Block-only ops of RvBlock, never produced by decoding.
+    // The extra inst closing a block that falls through
+    BLOCK_END = COUNT,
+    // Fused pairs
+    LUI_ADDI, AUIPC_ADDI, AUIPC_JALR, SLLI_SRLI, SLT_BRANCH, SLTU_BRANCH, SLTI_BRANCH,
+    BLOCK_COUNT
+};
+
+// Compact decoded instruction, trivially copyable so it can be stored in
+// arrays and passed between pipeline latches by value.
+// Fields an op doesn't use are 0.
+struct RvDecodedInst {
     enum hazard_t {
         H_RAW = 0,
         H_NOHAZARD = 1,
         H_WAR = 2,
         H_WAW = 3,
     };
-    static RvInst *decode(uint32_t inst = 0);
-
-    virtual std::string name() const = 0;
-    virtual std::string inst_name() const = 0;
-    virtual void exec(RvReg &reg) const = 0;
-    virtual void mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const;
-    virtual void write_back(RvReg &src, RvReg &dest) const = 0;
-    virtual RvInst *copy() const = 0;
-    virtual hazard_t data_hazard(RvInst *subsequent_inst);
-    virtual bool div_rem_ok(RvInst *subsequent_inst);
-    virtual uint64_t exec_cycle();
-};
-
-class RvRInst : public RvInst {
-    friend class RvInst;
-protected:
-    uint8_t funct3;
-    uint8_t funct7;
-    uint8_t rs1;
-    uint8_t rs2;
-    uint8_t rd;
-    RvRInst(uint32_t inst);
-    RvRInst(const RvRInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-    bool div_rem_ok(RvInst *subsequent_inst) override;
-    uint64_t exec_cycle() override;
-};
-
-class RvIInst : public RvInst {
-    friend class RvInst;
-protected:
-    uint8_t funct3;
+    using handler_t = RvExecResult (*)(const RvDecodedInst &inst, RvReg &reg);
+    handler_t handler;
     int64_t imm;
-    uint8_t rs1;
+    RvOp op;
     uint8_t rd;
-    std::optional<uint8_t> funct7;
-    RvIInst(uint32_t inst);
-    RvIInst(const RvIInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-};
-
-class RvSInst : public RvInst {
-    friend class RvInst;
-protected:
-    uint8_t funct3;
-    int64_t imm;
     uint8_t rs1;
     uint8_t rs2;
-    RvSInst(uint32_t inst);
-    RvSInst(const RvSInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-};
 
-class RvSBInst : public RvInst {
-    friend class RvInst;
-protected:
-    uint8_t funct3;
-    int64_t imm;
-    uint8_t rs1;
-    uint8_t rs2;
-    RvSBInst(uint32_t inst);
-    RvSBInst(const RvSBInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-    uint64_t get_target(uint64_t pc) const;
-};
-
-class RvUInst : public RvInst {
-    friend class RvInst;
-protected:
-    int64_t imm;
-    uint8_t rd;
-    RvUInst(uint32_t inst);
-    RvUInst(const RvUInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-};
-
-class RvUJInst : public RvInst {
-    friend class RvInst;
-protected:
-    int64_t imm;
-    uint8_t rd;
-    RvUJInst(uint32_t inst);
-    RvUJInst(const RvUJInst &) = default;
-public:
-    std::string name() const override;
-    std::string inst_name() const override;
-    void exec(RvReg &reg) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override;
-};
-
-class RvFaultInst : public RvInst {
-    friend class RvInst;
-protected:
-    RvFaultInst(const RvFaultInst &) = default;
-public:
-    RvFaultInst() = default;
-    std::string name() const override = 0;
-    std::string inst_name() const override = 0;
-    void exec(RvReg &reg) const override;
-    void mem(RvReg &reg, RvMem &mem, const RvMemAcc &meminfo) const override;
-    void write_back(RvReg &src, RvReg &dest) const override;
-    RvInst *copy() const override = 0;
-};
-
-class RvIllFInst : public RvFaultInst {
-    friend class RvInst;
-protected:
-    RvIllFInst(const RvIllFInst &) = default;
-public:
-    RvIllFInst() = default;
-    std::string name() const override;
-    std::string inst_name() const override;
-    RvInst *copy() const override;
-};
+    static RvDecodedInst decode(uint32_t inst = 0);
+    // A fault placeholder, op is ILLEGAL or MEM_FAULT
+    static RvDecodedInst fault(RvOp op);
+    // An inst from fields decoded earlier, ILLEGAL if op is out of range
+    static RvDecodedInst make(RvOp op, uint8_t rd, uint8_t rs1, uint8_t rs2, int64_t imm);
 
-class RvMemFInst : public RvFaultInst {
-    friend class RvInst;
-protected:
-    RvMemFInst(const RvMemFInst &) = default;
-public:
-    RvMemFInst() = default;
-    std::string name() const override;
-    std::string inst_name() const override;
-    RvInst *copy() const override;
+    RvExecResult exec(RvReg &reg) const { return handler(*this, reg); }
+    void mem(RvReg &reg, RvMem &mem, const RvMemAcc &info) const;
+    void write_back(RvReg &src, RvReg &dest) const;
+    std::string name() const;
+    const char *inst_name() const;
+    uint64_t exec_cycle() const;
+    bool is_branch() const { return op >= RvOp::BEQ && op <= RvOp::BGEU; }
+    bool is_fault() const { return op >= RvOp::ILLEGAL; }
+    // Branch target of SB-type insts
+    uint64_t get_target(uint64_t pc) const { return pc + imm; }
+    hazard_t data_hazard(const std::optional<RvDecodedInst> &subsequent_inst) const;
+    bool div_rem_ok(const std::optional<RvDecodedInst> &subsequent_inst) const;
 };
@@ -0,0 +1,738 @@
+#include "RvJit.h"
+
+#include <cstring>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "RvExcept.hpp"
+#include "RvOpTable.hpp"
+
+#ifdef RV_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+void RvJitState::flush_tlb()
+{
+    tlb_gen = *tlb_epoch;
+    for (auto &entry : read_tlb)
+        entry = { ~uint64_t{}, nullptr };
+    for (auto &entry : write_tlb)
+        entry = { ~uint64_t{}, nullptr };
+}
+
+#pragma region Helpers
+
+// Slow paths called by translated code. They must not throw through it,
+// so guest faults are parked in the state for RvJit::run.
+
+static void fill_tlb(RvJitState *state, RvJitState::tlb_entry *tlb, uint64_t addr, bool write)
+{
+    auto [host, perm]{ state->mem->host_page(addr) };
+    if (!(perm & (write ? RvMem::P_WRITE : RvMem::P_READ)) || (write && (perm & RvMem::P_EXEC)))
+        return;
+    tlb[(addr >> 12) & (RvJitState::TLB_SIZE - 1)] = { addr >> 12, static_cast<char *>(host) };
+}
+
+template <typename T>
+static uint64_t jit_load(RvJitState *state, uint64_t addr) noexcept
+{
+    try {
+        if (addr & (sizeof(T) - 1))
+            throw RvMisAlign(addr);
+        T value{ static_cast<T>((*state->mem)[addr]) };
+        fill_tlb(state, state->read_tlb, addr, false);
+        return static_cast<uint64_t>(value);
+    }
+    catch (const RvException &) {
+        state->error = std::current_exception();
+        state->fault = 1;
+        return 0;
+    }
+}
+
+template <typename T>
+static void jit_store(RvJitState *state, uint64_t addr, uint64_t value) noexcept
+{
+    try {
+        if (addr & (sizeof(T) - 1))
+            throw RvMisAlign(addr);
+        (*state->mem)[addr] = static_cast<T>(value);
+        // Copy-on-write pages move on their first write, read entries may be stale
+        if (*state->tlb_epoch != state->tlb_gen)
+            state->flush_tlb();
+        fill_tlb(state, state->write_tlb, addr, true);
+    }
+    catch (const RvException &) {
+        state->error = std::current_exception();
+        state->fault = 1;
+    }
+}
+
+#pragma endregion
+
+#ifdef RV_JIT_SUPPORTED
+
+#pragma region RvX86Emitter
+
+namespace {
+
+enum : int { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+// Condition codes of jcc and setcc
+enum : uint8_t { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xC, CC_GE = 0xD };
+// Group 1 and group 2 opcode extensions
+enum : int { EXT_ADD = 0, EXT_AND = 4, EXT_SUB = 5, EXT_CMP = 7 };
+enum : int { EXT_SHL = 4, EXT_SHR = 5, EXT_SAR = 7 };
+
+class RvX86Emitter {
+public:
+    std::vector<uint8_t> code;
+    void byte(uint8_t b) { code.push_back(b); }
+    void imm32(uint32_t v)
+    {
+        for (int i{ 0 }; i < 4; i++)
+            byte(v >> (i * 8));
+    }
+    void imm64(uint64_t v)
+    {
+        for (int i{ 0 }; i < 8; i++)
+            byte(v >> (i * 8));
+    }
+    void rex(bool w, int reg, int rm)
+    {
+        uint8_t prefix( 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3) );
+        if (prefix != 0x40)
+            byte(prefix);
+    }
+    // opcode reg, [base + disp32]
+    void op_mem(bool w, std::initializer_list<uint8_t> opcode, int reg, int base, int32_t disp)
+    {
+        rex(w, reg, base);
+        for (auto b : opcode)
+            byte(b);
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        imm32(disp);
+    }
+    // opcode reg, rm
+    void op_rr(bool w, std::initializer_list<uint8_t> opcode, int reg, int rm)
+    {
+        rex(w, reg, rm);
+        for (auto b : opcode)
+            byte(b);
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+    void load(int reg, int base, int32_t disp) { op_mem(true, { 0x8B }, reg, base, disp); }
+    void store(int base, int32_t disp, int reg) { op_mem(true, { 0x89 }, reg, base, disp); }
+    void mov(int dst, int src) { op_rr(true, { 0x89 }, src, dst); }
+    void mov_imm(int reg, uint64_t imm)
+    {
+        if (static_cast<int64_t>(imm) == static_cast<int32_t>(imm)) {
+            op_rr(true, { 0xC7 }, 0, reg);
+            imm32(static_cast<uint32_t>(imm));
+        }
+        else {
+            rex(true, 0, reg);
+            byte(0xB8 | (reg & 7));
+            imm64(imm);
+        }
+    }
+    void alu_imm(bool w, int ext, int reg, int32_t imm)
+    {
+        op_rr(w, { 0x81 }, ext, reg);
+        imm32(imm);
+    }
+    void shift_imm(int ext, int reg, uint8_t count)
+    {
+        op_rr(true, { 0xC1 }, ext, reg);
+        byte(count);
+    }
+    void push(int reg)
+    {
+        rex(false, 0, reg);
+        byte(0x50 | (reg & 7));
+    }
+    void pop(int reg)
+    {
+        rex(false, 0, reg);
+        byte(0x58 | (reg & 7));
+    }
+    void call(const void *fn)
+    {
+        mov_imm(RAX, reinterpret_cast<uint64_t>(fn));
+        op_rr(false, { 0xFF }, 2, RAX);
+    }
+    void jmp_reg(int reg) { op_rr(false, { 0xFF }, 4, reg); }
+    void jmp_abs(const void *target)
+    {
+        mov_imm(RCX, reinterpret_cast<uint64_t>(target));
+        jmp_reg(RCX);
+    }
+    // Jumps return the position of rel32 to be bound later
+    size_t jcc(uint8_t cc)
+    {
+        byte(0x0F);
+        byte(0x80 | cc);
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t jmp()
+    {
+        byte(0xE9);
+        imm32(0);
+        return code.size() - 4;
+    }
+    void bind(size_t rel)
+    {
+        uint32_t disp( code.size() - (rel + 4) );
+        std::memcpy(code.data() + rel, &disp, 4);
+    }
+};
+
+constexpr int32_t reg_off(uint8_t id)
+{
+    return static_cast<int32_t>(offsetof(RvBlockContext, x) + id * sizeof(uint64_t));
+}
+constexpr int32_t PC_OFF{ offsetof(RvBlockContext, pc) };
+constexpr int32_t READ_TLB_OFF{ offsetof(RvJitState, read_tlb) };
+constexpr int32_t WRITE_TLB_OFF{ offsetof(RvJitState, write_tlb) };
+constexpr int32_t RETIRED_OFF{ offsetof(RvJitState, retired) };
+constexpr int32_t FAULT_OFF{ offsetof(RvJitState, fault) };
+constexpr int32_t SYSCALL_OFF{ offsetof(RvJitState, syscall) };
+constexpr int32_t BUDGET_OFF{ offsetof(RvJitState, budget) };
+constexpr int32_t EPOCH_OFF{ offsetof(RvJitState, epoch) };
+constexpr int32_t CODE_GEN_OFF{ offsetof(RvJitState, code_gen) };
+constexpr int32_t LAST_OFF{ offsetof(RvJitState, last) };
+static_assert(sizeof(RvJitState::tlb_entry) == 16);
+// Translated code follows links through the blocks themselves
+static_assert(std::is_standard_layout_v<RvBlock>);
+constexpr int32_t LENGTH_OFF{ offsetof(RvBlock, length) };
+constexpr int32_t NATIVE_OFF{ offsetof(RvBlock, native) };
+constexpr int32_t JALR_PC_OFF{ offsetof(RvBlock, jalr_pc) };
+constexpr int32_t JALR_BLOCK_OFF{ offsetof(RvBlock, jalr_block) };
+
+// rax = rax op rcx, for R-type and I-type arithmetic
+void emit_alu(RvX86Emitter &e, RvOp op)
+{
+    switch (op) {
+    case RvOp::ADD:
+    case RvOp::ADDI:
+        e.op_rr(true, { 0x01 }, RCX, RAX);
+        break;
+    case RvOp::SUB:
+        e.op_rr(true, { 0x29 }, RCX, RAX);
+        break;
+    case RvOp::XOR:
+    case RvOp::XORI:
+        e.op_rr(true, { 0x31 }, RCX, RAX);
+        break;
+    case RvOp::OR:
+    case RvOp::ORI:
+        e.op_rr(true, { 0x09 }, RCX, RAX);
+        break;
+    case RvOp::AND:
+    case RvOp::ANDI:
+        e.op_rr(true, { 0x21 }, RCX, RAX);
+        break;
+    case RvOp::SLT:
+    case RvOp::SLTI:
+    case RvOp::SLTU:
+        e.op_rr(true, { 0x39 }, RCX, RAX);
+        e.op_rr(false, { 0x0F, static_cast<uint8_t>(0x90 | (op == RvOp::SLTU ? CC_B : CC_L)) }, 0, RAX);
+        e.op_rr(false, { 0x0F, 0xB6 }, RAX, RAX);
+        break;
+    case RvOp::SLL:
+    case RvOp::SLLI:
+        e.op_rr(true, { 0xD3 }, EXT_SHL, RAX);
+        break;
+    case RvOp::SRL:
+    case RvOp::SRLI:
+        e.op_rr(true, { 0xD3 }, EXT_SHR, RAX);
+        break;
+    case RvOp::SRA:
+    case RvOp::SRAI:
+        e.op_rr(true, { 0xD3 }, EXT_SAR, RAX);
+        break;
+    case RvOp::MUL:
+        e.op_rr(true, { 0x0F, 0xAF }, RAX, RCX);
+        break;
+    case RvOp::MULH:
+        // imulh widens its unsigned operands, so this is an unsigned multiply
+        e.op_rr(true, { 0xF7 }, 4, RCX);
+        e.mov(RAX, RDX);
+        break;
+    // 32-bit ops sign-extend their result
+    case RvOp::ADDW:
+    case RvOp::ADDIW:
+        e.op_rr(false, { 0x01 }, RCX, RAX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    case RvOp::SUBW:
+        e.op_rr(false, { 0x29 }, RCX, RAX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    case RvOp::MULW:
+        e.op_rr(false, { 0x0F, 0xAF }, RAX, RCX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    case RvOp::SLLIW:
+        e.op_rr(false, { 0xD3 }, EXT_SHL, RAX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    case RvOp::SRLIW:
+        e.op_rr(false, { 0xD3 }, EXT_SHR, RAX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    case RvOp::SRAIW:
+        e.op_rr(false, { 0xD3 }, EXT_SAR, RAX);
+        e.op_rr(true, { 0x63 }, RAX, RAX);
+        break;
+    default:
+        // Division keeps the interpreter's semantics by calling the same function
+        e.mov(RDI, RAX);
+        e.mov(RSI, RCX);
+        e.call(reinterpret_cast<const void *>(r_entry(op).fn));
+        break;
+    }
+}
+
+// rdx = host address of guest address rax, jumps to the returned rel32 on a miss
+size_t emit_tlb_lookup(RvX86Emitter &e, int32_t tlb_off)
+{
+    e.mov(RCX, RAX);
+    e.shift_imm(EXT_SHR, RCX, 12);
+    e.mov(RDX, RCX);
+    e.alu_imm(false, EXT_AND, RDX, RvJitState::TLB_SIZE - 1);
+    e.shift_imm(EXT_SHL, RDX, 4);
+    e.op_rr(true, { 0x01 }, R12, RDX);
+    e.op_mem(true, { 0x3B }, RCX, RDX, tlb_off);
+    auto miss{ e.jcc(CC_NE) };
+    e.load(RDX, RDX, tlb_off + 8);
+    e.alu_imm(false, EXT_AND, RAX, 0xfff);
+    e.op_rr(true, { 0x01 }, RAX, RDX);
+    return miss;
+}
+
+struct mem_op_t {
+    // Host load into rax or store from rcx at [rdx], op1 is 0 for one-byte opcodes
+    uint8_t op0;
+    uint8_t op1;
+    bool w;
+    bool opsize16;
+    const void *helper;
+    size_t width;
+};
+
+mem_op_t mem_op(RvOp op)
+{
+    switch (op) {
+    case RvOp::LB: return { 0x0F, 0xBE, true, false, reinterpret_cast<const void *>(jit_load<int8_t>), 1 };
+    case RvOp::LH: return { 0x0F, 0xBF, true, false, reinterpret_cast<const void *>(jit_load<int16_t>), 2 };
+    case RvOp::LW: return { 0x63, 0, true, false, reinterpret_cast<const void *>(jit_load<int32_t>), 4 };
+    case RvOp::LD: return { 0x8B, 0, true, false, reinterpret_cast<const void *>(jit_load<uint64_t>), 8 };
+    case RvOp::LBU: return { 0x0F, 0xB6, true, false, reinterpret_cast<const void *>(jit_load<uint8_t>), 1 };
+    case RvOp::LHU: return { 0x0F, 0xB7, true, false, reinterpret_cast<const void *>(jit_load<uint16_t>), 2 };
+    case RvOp::LWU: return { 0x8B, 0, false, false, reinterpret_cast<const void *>(jit_load<uint32_t>), 4 };
+    case RvOp::SB: return { 0x88, 0, false, false, reinterpret_cast<const void *>(jit_store<uint8_t>), 1 };
+    case RvOp::SH: return { 0x89, 0, false, true, reinterpret_cast<const void *>(jit_store<uint16_t>), 2 };
+    case RvOp::SW: return { 0x89, 0, false, false, reinterpret_cast<const void *>(jit_store<uint32_t>), 4 };
+    default: return { 0x89, 0, true, false, reinterpret_cast<const void *>(jit_store<uint64_t>), 8 };
+    }
+}
+
+void emit_host_access(RvX86Emitter &e, const mem_op_t &info, int reg)
+{
+    if (info.opsize16)
+        e.byte(0x66);
+    if (info.op1)
+        e.op_mem(info.w, { info.op0, info.op1 }, reg, RDX, 0);
+    else
+        e.op_mem(info.w, { info.op0 }, reg, RDX, 0);
+}
+
+}
+
+#pragma endregion
+
+#endif
+
+#pragma region RvJit
+
+RvJit::RvJit(RvMem &mem, size_t code_size)
+    : code_base{}
+    , code_write{}
+    , code_size{}
+    , code_used{}
+    , enter{}
+    , leave{}
+    , state{}
+{
+    state.mem = &mem;
+    state.code_gen = &mem.code_generation();
+    state.tlb_epoch = &mem.tlb_generation();
+    state.flush_tlb();
+#ifdef RV_JIT_SUPPORTED
+    // Without executable memory every block stays interpreted
+    int fd{ ::memfd_create("RvJit", MFD_CLOEXEC) };
+    if (fd < 0)
+        return;
+    void *base{ MAP_FAILED };
+    void *write{ MAP_FAILED };
+    if (::ftruncate(fd, code_size) == 0) {
+        base = ::mmap(nullptr, code_size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        write = ::mmap(nullptr, code_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    // The mappings keep the memory
+    ::close(fd);
+    if (base == MAP_FAILED || write == MAP_FAILED) {
+        if (base != MAP_FAILED)
+            ::munmap(base, code_size);
+        if (write != MAP_FAILED)
+            ::munmap(write, code_size);
+        return;
+    }
+    code_base = static_cast<char *>(base);
+    code_write = static_cast<char *>(write);
+    this->code_size = code_size;
+
+    // rbx holds the context and r12 the state, rsp is kept 16-byte aligned for helpers
+    RvX86Emitter e;
+    e.push(RBX);
+    e.push(R12);
+    e.alu_imm(true, EXT_SUB, RSP, 8);
+    e.mov(RBX, RDI);
+    e.mov(R12, RSI);
+    e.jmp_reg(RDX);
+    size_t leave_off{ e.code.size() };
+    e.alu_imm(true, EXT_ADD, RSP, 8);
+    e.pop(R12);
+    e.pop(RBX);
+    e.byte(0xC3);
+    std::memcpy(code_write, e.code.data(), e.code.size());
+    enter = reinterpret_cast<enter_t>(code_base);
+    leave = code_base + leave_off;
+    code_used = (e.code.size() + 15) & ~size_t{ 15 };
+#endif
+}
+
+RvJit::~RvJit()
+{
+#ifdef RV_JIT_SUPPORTED
+    if (code_base) {
+        ::munmap(code_base, code_size);
+        ::munmap(code_write, code_size);
+    }
+#endif
+}
+
+void *RvJit::compile(const RvBlock &code, const RvBlock &home)
+{
+#ifdef RV_JIT_SUPPORTED
+    if (!code_base)
+        return nullptr;
+    RvX86Emitter e;
+    // rel32 of jumps to the fault exit of an inst
+    std::vector<std::pair<size_t, size_t>> to_fault;
+
+    // Back to the runtime with the next pc in rax
+    auto emit_leave{ [&] {
+        e.store(RBX, PC_OFF, RAX);
+        e.mov_imm(RDX, reinterpret_cast<uint64_t>(&home));
+        e.store(R12, LAST_OFF, RDX);
+        e.jmp_abs(leave);
+    } };
+    auto emit_retire{ [&](size_t retired) {
+        e.op_mem(true, { 0x81 }, EXT_ADD, R12, RETIRED_OFF);
+        e.imm32(static_cast<uint32_t>(retired));
+    } };
+    auto emit_exit{ [&](size_t retired) {
+        emit_retire(retired);
+        emit_leave();
+    } };
+    // Go on to block rdx at pc rax if it's translated, within budget and
+    // still current, leave otherwise
+    auto emit_chain{ [&] {
+        e.op_rr(true, { 0x85 }, RDX, RDX);
+        auto no_block{ e.jcc(CC_E) };
+        e.load(RCX, RDX, NATIVE_OFF);
+        e.op_rr(true, { 0x85 }, RCX, RCX);
+        auto no_code{ e.jcc(CC_E) };
+        e.load(RSI, R12, RETIRED_OFF);
+        e.op_mem(true, { 0x03 }, RSI, RDX, LENGTH_OFF);
+        e.op_mem(true, { 0x3B }, RSI, R12, BUDGET_OFF);
+        auto over_budget{ e.jcc(CC_A) };
+        e.load(RSI, R12, CODE_GEN_OFF);
+        e.load(RSI, RSI, 0);
+        e.op_mem(true, { 0x3B }, RSI, R12, EPOCH_OFF);
+        auto stale{ e.jcc(CC_NE) };
+        e.jmp_reg(RCX);
+        for (auto rel : { no_block, no_code, over_budget, stale })
+            e.bind(rel);
+        emit_leave();
+    } };
+    // Direct exits read their link slot when taken, so links made later are followed
+    auto emit_link_exit{ [&](size_t retired, int slot) {
+        emit_retire(retired);
+        e.mov_imm(RDX, reinterpret_cast<uint64_t>(&home.link[slot]));
+        e.load(RDX, RDX, 0);
+        emit_chain();
+    } };
+    auto emit_fault_check{ [&](size_t index) {
+        e.op_mem(false, { 0x80 }, EXT_CMP, R12, FAULT_OFF);
+        e.byte(0);
+        to_fault.push_back({ e.jcc(CC_NE), index });
+    } };
+
+    for (size_t i{ 0 }; i < code.insts.size(); i++) {
+        auto &inst{ code.insts[i] };
+        uint64_t pc{ code.start_pc + i * 4 };
+        // Translated code has no dispatch to save, fused pairs run as is
+        auto op{ RvBlock::unfused(inst.op) };
+        switch (op) {
+        case RvOp::ADD: case RvOp::MUL: case RvOp::SUB: case RvOp::SLL: case RvOp::MULH:
+        case RvOp::SLT: case RvOp::SLTU: case RvOp::XOR: case RvOp::DIV: case RvOp::SRL:
+        case RvOp::DIVU: case RvOp::SRA: case RvOp::OR: case RvOp::REM: case RvOp::AND:
+        case RvOp::REMU: case RvOp::ADDW: case RvOp::MULW: case RvOp::SUBW: case RvOp::DIVW:
+        case RvOp::REMW:
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.load(RCX, RBX, reg_off(inst.rs2));
+            emit_alu(e, op);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            break;
+        case RvOp::ADDI: case RvOp::SLTI: case RvOp::XORI: case RvOp::ORI: case RvOp::ANDI:
+        case RvOp::SLLI: case RvOp::SRLI: case RvOp::SRAI: case RvOp::ADDIW: case RvOp::SLLIW:
+        case RvOp::SRLIW: case RvOp::SRAIW:
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.mov_imm(RCX, inst.imm);
+            emit_alu(e, op);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            break;
+        case RvOp::LB: case RvOp::LH: case RvOp::LW: case RvOp::LD:
+        case RvOp::LBU: case RvOp::LHU: case RvOp::LWU: {
+            auto info{ mem_op(op) };
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.alu_imm(true, EXT_ADD, RAX, static_cast<int32_t>(inst.imm));
+            size_t misaligned{};
+            if (info.width > 1) {
+                // test al, width - 1
+                e.byte(0xA8);
+                e.byte(static_cast<uint8_t>(info.width - 1));
+                misaligned = e.jcc(CC_NE);
+            }
+            auto miss{ emit_tlb_lookup(e, READ_TLB_OFF) };
+            emit_host_access(e, info, RAX);
+            auto done{ e.jmp() };
+            if (info.width > 1)
+                e.bind(misaligned);
+            e.bind(miss);
+            e.mov(RDI, R12);
+            e.mov(RSI, RAX);
+            e.call(info.helper);
+            emit_fault_check(i);
+            e.bind(done);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            break;
+        }
+        case RvOp::SB: case RvOp::SH: case RvOp::SW: case RvOp::SD: {
+            auto info{ mem_op(op) };
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.alu_imm(true, EXT_ADD, RAX, static_cast<int32_t>(inst.imm));
+            size_t misaligned{};
+            if (info.width > 1) {
+                e.byte(0xA8);
+                e.byte(static_cast<uint8_t>(info.width - 1));
+                misaligned = e.jcc(CC_NE);
+            }
+            auto miss{ emit_tlb_lookup(e, WRITE_TLB_OFF) };
+            e.load(RCX, RBX, reg_off(inst.rs2));
+            emit_host_access(e, info, RCX);
+            auto done{ e.jmp() };
+            if (info.width > 1)
+                e.bind(misaligned);
+            e.bind(miss);
+            e.mov(RDI, R12);
+            e.mov(RSI, RAX);
+            e.load(RDX, RBX, reg_off(inst.rs2));
+            e.call(info.helper);
+            emit_fault_check(i);
+            e.bind(done);
+            break;
+        }
+        case RvOp::BEQ: case RvOp::BNE: case RvOp::BLT:
+        case RvOp::BGE: case RvOp::BLTU: case RvOp::BGEU: {
+            constexpr uint8_t cc[]{ CC_E, CC_NE, CC_L, CC_GE, CC_B, CC_AE };
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.op_mem(true, { 0x3B }, RAX, RBX, reg_off(inst.rs2));
+            auto taken{ e.jcc(cc[static_cast<size_t>(op) - static_cast<size_t>(RvOp::BEQ)]) };
+            e.mov_imm(RAX, pc + 4);
+            emit_link_exit(i + 1, 1);
+            e.bind(taken);
+            e.mov_imm(RAX, inst.get_target(pc));
+            emit_link_exit(i + 1, 0);
+            break;
+        }
+        case RvOp::JALR: {
+            // rd may be rs1
+            e.load(RAX, RBX, reg_off(inst.rs1));
+            e.alu_imm(true, EXT_ADD, RAX, static_cast<int32_t>(inst.imm));
+            e.mov_imm(RCX, pc + 4);
+            e.store(RBX, reg_off(inst.rd), RCX);
+            emit_retire(i + 1);
+            // Inline cache of the last target
+            e.mov_imm(RDX, reinterpret_cast<uint64_t>(&home));
+            e.op_mem(true, { 0x3B }, RAX, RDX, JALR_PC_OFF);
+            auto miss{ e.jcc(CC_NE) };
+            e.load(RDX, RDX, JALR_BLOCK_OFF);
+            emit_chain();
+            e.bind(miss);
+            emit_leave();
+            break;
+        }
+        case RvOp::JAL:
+            e.mov_imm(RAX, pc + 4);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            e.mov_imm(RAX, pc + inst.imm);
+            emit_link_exit(i + 1, 0);
+            break;
+        case RvOp::AUIPC:
+            e.mov_imm(RAX, pc + inst.imm);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            break;
+        case RvOp::LUI:
+            e.mov_imm(RAX, inst.imm);
+            e.store(RBX, reg_off(inst.rd), RAX);
+            break;
+        case RvOp::ECALL:
+            e.op_mem(false, { 0xC6 }, 0, R12, SYSCALL_OFF);
+            e.byte(1);
+            e.mov_imm(RAX, pc + 4);
+            emit_exit(i + 1);
+            break;
+        case RvOp::FENCE_I:
+            // The runtime drops stale blocks before running on
+            e.mov_imm(RAX, pc + 4);
+            emit_exit(i + 1);
+            break;
+        case RvBlock::END:
+            e.mov_imm(RAX, pc);
+            emit_link_exit(i, 1);
+            break;
+        default:
+            // Faulting blocks are left to the interpreter
+            return nullptr;
+        }
+    }
+
+    // Precise exits of faulting insts
+    for (auto [rel, index] : to_fault) {
+        e.bind(rel);
+        e.mov_imm(RAX, code.start_pc + index * 4);
+        emit_exit(index);
+    }
+
+    // Keep entries 16-byte aligned
+    auto size{ (e.code.size() + 15) & ~size_t{ 15 } };
+    auto used{ code_used.load(std::memory_order_relaxed) };
+    do {
+        if (code_size - used < size)
+            return nullptr;
+    } while (!code_used.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+    std::memcpy(code_write + used, e.code.data(), e.code.size());
+    return code_base + used;
+#else
+    return nullptr;
+#endif
+}
+
+RvBlock *RvJit::run(void *code, RvBlockContext &ctx, uint64_t &inst_exec, uint64_t limit, uint64_t epoch)
+{
+    state.retired = 0;
+    state.budget = limit - inst_exec;
+    state.epoch = epoch;
+    state.syscall = 0;
+    // Pages may have moved while other engines ran
+    if (*state.tlb_epoch != state.tlb_gen)
+        state.flush_tlb();
+    state.last = nullptr;
+    enter(&ctx, &state, code);
+    inst_exec += state.retired;
+    if (state.fault) {
+        state.fault = 0;
+        std::rethrow_exception(std::exchange(state.error, nullptr));
+    }
+    return state.last;
+}
+
+#pragma endregion
+
+#pragma region RvJitCompiler
+
+RvJitCompiler::RvJitCompiler(RvJit &jit, size_t threads)
+    : jit{ jit }
+    , in_flight{}
+    , signal{}
+    , stopping{}
+{
+    for (size_t i{ 0 }; i < threads; i++)
+        workers.emplace_back(&RvJitCompiler::work, this);
+}
+
+RvJitCompiler::~RvJitCompiler()
+{
+    stopping.store(true);
+    signal.fetch_add(1, std::memory_order_release);
+    signal.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    task_t *task;
+    while (requests.pop(task))
+        delete task;
+    while (results.pop(task))
+        delete task;
+}
+
+void RvJitCompiler::work()
+{
+    for (;;) {
+        // Read before polling, so a request pushed after a miss still wakes us
+        auto seen{ signal.load(std::memory_order_acquire) };
+        task_t *task;
+        if (requests.pop(task)) {
+            auto start{ std::chrono::steady_clock::now() };
+            task->native = jit.compile(task->code, *task->home);
+            task->compile_time = std::chrono::steady_clock::now() - start;
+            // Can't fail, at most MAX_TASKS are in flight
+            results.push(task);
+            continue;
+        }
+        if (stopping.load())
+            return;
+        signal.wait(seen, std::memory_order_acquire);
+    }
+}
+
+bool RvJitCompiler::submit(RvBlock &block)
+{
+    if (in_flight == MAX_TASKS)
+        return false;
+    auto task{ new task_t{ block, &block, block.id, nullptr, std::chrono::steady_clock::now(), {} } };
+    requests.push(task);
+    in_flight++;
+    signal.fetch_add(1, std::memory_order_release);
+    signal.notify_one();
+    return true;
+}
+
+std::unique_ptr<RvJitCompiler::task_t> RvJitCompiler::poll()
+{
+    task_t *task;
+    if (!results.pop(task))
+        return nullptr;
+    in_flight--;
+    return std::unique_ptr<task_t>{ task };
+}
+
+#pragma endregion
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "RvBlock.h"
+#include "RvMem.h"
+#include "RvQueue.hpp"
+
+// Translated code follows the System V x86-64 ABI
+#if defined(__x86_64__) && defined(__linux__)
+#define RV_JIT_SUPPORTED
+#endif
+
+// State translated code shares with the runtime, besides RvBlockContext
+struct RvJitState {
+    static constexpr size_t TLB_SIZE{ 256 };
+    // Guest page number to host page, tag is ~0 if empty
+    struct tlb_entry {
+        uint64_t tag;
+        char *host;
+    };
+    tlb_entry read_tlb[TLB_SIZE];
+    // Executable pages never get here, so their writes still bump the generation
+    tlb_entry write_tlb[TLB_SIZE];
+    // Insts retired by the last run, chaining stops before it exceeds budget
+    uint64_t retired;
+    uint64_t budget;
+    // Chaining also stops once code_gen moves away from the epoch of the block cache
+    uint64_t epoch;
+    const uint64_t *code_gen;
+    // RvMem TLB epoch, moves whenever host pages of mapped guest pages may
+    // have changed or writes must be tracked again
+    const uint64_t *tlb_epoch;
+    // tlb_epoch when the TLBs were last flushed
+    uint64_t tlb_gen;
+    // Block the last run left from
+    RvBlock *last;
+    // Set by helpers when the guest faults, error holds the exception
+    uint8_t fault;
+    uint8_t syscall;
+    RvMem *mem;
+    std::exception_ptr error;
+    void flush_tlb();
+};
+
+// Translates blocks into host code in an executable code cache. The cache
+// is mapped twice, never writable and executable at once: code runs from
+// code_base and is only written through code_write, at the same offset
+class RvJit {
+    char *code_base;
+    char *code_write;
+    size_t code_size;
+    // Blocks may be translated on several threads at once
+    std::atomic<size_t> code_used;
+    // Shared trampolines into and out of translated code
+    using enter_t = void (*)(RvBlockContext *ctx, RvJitState *state, void *code);
+    enter_t enter;
+    void *leave;
+    RvJit(const RvJit &) = delete;
+    RvJit &operator=(const RvJit &) = delete;
+public:
+    RvJitState state;
+    RvJit(RvMem &mem, size_t code_size = 16 << 20);
+    ~RvJit();
+    // nullptr if the block can't be translated or the code cache is full.
+    // The code jumps straight to translated blocks linked to this one
+    void *compile(const RvBlock &block) { return compile(block, block); }
+    // Translate the insts of code to run as home, code may be a copy of home
+    // made for another thread. home is only referred to, never read here
+    void *compile(const RvBlock &code, const RvBlock &home);
+    // Run translated code while inst_exec stays within limit and the block
+    // cache is at epoch, adding retired insts to inst_exec. Guest faults are
+    // rethrown, state.syscall tells if the guest issued a syscall.
+    // Returns the block it left from
+    RvBlock *run(void *code, RvBlockContext &ctx, uint64_t &inst_exec, uint64_t limit, uint64_t epoch);
+};
+
+// Translates blocks on worker threads. Tasks carry a copy of their block,
+// so blocks may be dropped meanwhile; finished tasks are matched back to
+// blocks by id on the emulation thread
+class RvJitCompiler {
+public:
+    static constexpr size_t MAX_TASKS{ 256 };
+    struct task_t {
+        RvBlock code;
+        RvBlock *home;
+        uint64_t block_id;
+        void *native;
+        std::chrono::steady_clock::time_point queued;
+        std::chrono::nanoseconds compile_time;
+    };
+private:
+    RvJit &jit;
+    RvMpmcQueue<task_t *, MAX_TASKS> requests;
+    RvMpmcQueue<task_t *, MAX_TASKS> results;
+    // Tasks submitted and not polled yet, so results never overflow
+    size_t in_flight;
+    // Bumped on every request, idle workers wait for it to change
+    std::atomic<uint64_t> signal;
+    std::atomic<bool> stopping;
+    std::vector<std::thread> workers;
+    void work();
+    RvJitCompiler(const RvJitCompiler &) = delete;
+    RvJitCompiler &operator=(const RvJitCompiler &) = delete;
+public:
+    RvJitCompiler(RvJit &jit, size_t threads);
+    ~RvJitCompiler();
+    // Queue block for translation, false if too many tasks are in flight.
+    // Only called from the emulation thread, as is poll
+    bool submit(RvBlock &block);
+    // A finished task, nullptr if there's none
+    std::unique_ptr<task_t> poll();
+    // Requests not picked up by a worker yet
+    size_t depth() const { return requests.size(); }
+};
@@ -1,66 +1,668 @@
 #include "RvMem.h"
 
-RvMem::RvMem()
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RV_MEM_FLAT
+#include <csignal>
+#include <sys/mman.h>
+#endif
+
+#ifdef RV_MEM_FLAT
+
+// Flat memories alive, looked up by the fault handler
+static std::array<std::atomic<RvMem *>, 16> flat_mems{};
+static struct sigaction prev_segv, prev_bus;
+
+struct RvMemFaultHandler {
+    // Only guest accesses fault in a region, and those are synchronous, so
+    // the page table is consistent here. Thrown through the signal frame,
+    // which needs -fnon-call-exceptions
+    static void handle(int sig, siginfo_t *info, void *)
+    {
+        auto host{ static_cast<char *>(info->si_addr) };
+        for (auto &slot : flat_mems) {
+            auto mem{ slot.load(std::memory_order_acquire) };
+            if (!mem || host < mem->flat_base || host >= mem->flat_base + mem->flat_size)
+                continue;
+            uint64_t addr = host - mem->flat_base;
+            // Nothing may allocate until it's back, see dirty_room and pin_table
+            mem->in_fault = true;
+            auto resumed{ mem->flat_resume(addr) };
+            mem->in_fault = false;
+            if (resumed)
+                return;
+            throw RvAccVio(addr);
+        }
+        // Not ours, faulting again hands it to whoever was there before
+        ::sigaction(sig, sig == SIGSEGV ? &prev_segv : &prev_bus, nullptr);
+    }
+    static void install()
+    {
+        struct sigaction action {};
+        action.sa_sigaction = handle;
+        // Handlers are left by throwing, so the signal must stay unblocked
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(SIGSEGV, &action, &prev_segv);
+        ::sigaction(SIGBUS, &action, &prev_bus);
+    }
+};
+
+// Host protection of a guest page, exec pages are read by fetch. Writes to
+// writable pages fault while they must be tracked
+static int host_prot(int perm, bool writable)
+{
+    int prot{ PROT_NONE };
+    if (perm & (RvMem::P_READ | RvMem::P_EXEC))
+        prot |= PROT_READ;
+    if ((perm & RvMem::P_WRITE) && writable)
+        prot |= PROT_WRITE;
+    return prot;
+}
+
+#endif
+
+// Ask the host for transparent huge pages, buf must be HUGE_SIZE aligned
+static void advise_huge(void *buf)
+{
+#if defined(RV_MEM_FLAT) && defined(MADV_HUGEPAGE)
+    ::madvise(buf, RvMem::HUGE_SIZE, MADV_HUGEPAGE);
+#endif
+}
+
+RvMem::RvMem(bool flat)
+    : gen_counter{}
+    , flat_base{}
+    , flat_size{}
+    , flat_unreadable{}
+    , tlb_stat{}
+    , tlb_epoch{}
+{
+    flush_tlb();
+#ifdef RV_MEM_FLAT
+    if (!flat)
+        return;
+    // Over-reserve and trim so huge pages line up with host ones
+    void *base{ ::mmap(nullptr, FLAT_SIZE + HUGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) };
+    if (base == MAP_FAILED)
+        return;
+    auto head{ (HUGE_SIZE - reinterpret_cast<uintptr_t>(base) % HUGE_SIZE) % HUGE_SIZE };
+    if (head)
+        ::munmap(base, head);
+    ::munmap(static_cast<char *>(base) + head + FLAT_SIZE, HUGE_SIZE - head);
+    static std::once_flag installed;
+    std::call_once(installed, RvMemFaultHandler::install);
+    flat_base = static_cast<char *>(base) + head;
+    flat_size = FLAT_SIZE;
+    for (auto &slot : flat_mems) {
+        RvMem *expected{};
+        if (slot.compare_exchange_strong(expected, this, std::memory_order_release))
+            return;
+    }
+    ::munmap(flat_base, FLAT_SIZE);
+    flat_base = nullptr;
+    flat_size = 0;
+#endif
+}
+
+void RvMem::flush_tlb()
+{
+    ++tlb_epoch;
+    for (auto &kind : tlb)
+        for (auto &entry : kind)
+            entry = { ~uint64_t{}, nullptr, nullptr };
+}
+
+void RvMem::flat_protect(uint64_t addr, const pg_entry &entry)
+{
+#ifdef RV_MEM_FLAT
+    uint64_t size{ entry.huge ? HUGE_SIZE : 1 << 12 };
+    if (!(entry.perm & P_READ))
+        flat_unreadable = true;
+    ::mprotect(flat_base + (addr & ~(size - 1)), size, host_prot(entry.perm, !entry.cached && entry.dirty));
+#endif
+}
+
+void RvMem::flat_release(uint64_t addr, const pg_entry &entry)
+{
+#ifdef RV_MEM_FLAT
+    uint64_t size{ entry.huge ? HUGE_SIZE : 1 << 12 };
+    auto page{ flat_base + (addr & ~(size - 1)) };
+    ::mprotect(page, size, PROT_NONE);
+    ::madvise(page, size, MADV_DONTNEED);
+#endif
+}
+
+bool RvMem::flat_resume(uint64_t addr)
+{
+    auto entry{ find_page(addr) };
+    if (!entry)
+        return find_or_grow(addr, true) != nullptr;
+    if (!(entry->perm & P_WRITE) || (!entry->cached && entry->dirty))
+        return false;
+    // Same as write() and tlb_fill() do for pages outside the region
+    if (entry->cached) {
+        entry->cached = false;
+        entry->gen = ++gen_counter;
+    }
+    mark_dirty(*entry, addr);
+    flat_protect(addr, *entry);
+    return true;
+}
+
+RvMem::pg_entry *RvMem::find_page(uint64_t addr)
+{
+    if (addr >> ADDR_BITS)
+        return nullptr;
+    auto &upper{ page_table[addr >> 39] };
+    if (!upper)
+        return nullptr;
+    auto &dir{ upper->dir[(addr >> 30) % PT_FANOUT] };
+    if (!dir)
+        return nullptr;
+    auto slot{ (addr >> 21) % PT_FANOUT };
+    if (dir->huge[slot].addr)
+        return &dir->huge[slot];
+    auto &leaf{ dir->leaf[slot] };
+    if (!leaf)
+        return nullptr;
+    auto &entry{ leaf->page[(addr >> 12) % PT_FANOUT] };
+    return entry.addr ? &entry : nullptr;
+}
+
+// Backs reserved pages that have only been read so far
+alignas(4096) static const char zero_page[1 << 12]{};
+
+RvMem::pg_entry *RvMem::find_or_grow(uint64_t addr, bool write)
 {
-    return;
+    if (auto entry{ find_page(addr) })
+        return entry;
+    for (auto &region : regions) {
+        if (addr < region.start || addr >= region.end)
+            continue;
+        // Shared until the first write, region pages read as zero already
+        if (!write && !in_flat(addr))
+            return map_cow_page(addr, region.perm, zero_page) ? find_page(addr) : nullptr;
+        if (!new_page(addr, region.perm))
+            return nullptr;
+        auto entry{ find_page(addr) };
+        if (!in_flat(addr))
+            std::memset(entry->addr, 0, 1 << 12);
+        return entry;
+    }
+    return nullptr;
+}
+
+RvMem::pg_entry *RvMem::insert_page(uint64_t addr, bool huge)
+{
+    if (addr >> ADDR_BITS)
+        return nullptr;
+    auto &upper{ page_table[addr >> 39] };
+    if (!upper)
+        upper = std::make_unique<pt_upper>();
+    auto &dir{ upper->dir[(addr >> 30) % PT_FANOUT] };
+    if (!dir) {
+        dir = std::make_unique<pt_dir>();
+        upper->used++;
+    }
+    auto slot{ (addr >> 21) % PT_FANOUT };
+    if (dir->huge[slot].addr)
+        return nullptr;
+    if (huge) {
+        if (dir->leaf[slot])
+            return nullptr;
+        dir->used++;
+        if (in_flat(addr))
+            dirty_room++;
+        note_dirty(addr & ~(HUGE_SIZE - 1));
+        return &dir->huge[slot];
+    }
+    auto &leaf{ dir->leaf[slot] };
+    if (!leaf) {
+        leaf = std::make_unique<pt_leaf>();
+        dir->used++;
+    }
+    auto &entry{ leaf->page[(addr >> 12) % PT_FANOUT] };
+    if (entry.addr)
+        return nullptr;
+    leaf->used++;
+    if (in_flat(addr))
+        dirty_room++;
+    note_dirty(addr & ~0xfffull);
+    return &entry;
+}
+
+void RvMem::erase_page(uint64_t addr)
+{
+    auto &upper{ page_table[addr >> 39] };
+    auto &dir{ upper->dir[(addr >> 30) % PT_FANOUT] };
+    auto slot{ (addr >> 21) % PT_FANOUT };
+    if (in_flat(addr))
+        dirty_room--;
+    if (dir->huge[slot].addr) {
+        // Nothing is left to tell how large it was
+        for (uint64_t page{ addr & ~(HUGE_SIZE - 1) }; page < (addr | (HUGE_SIZE - 1)); page += 1 << 12)
+            note_dirty(page);
+        dir->huge[slot] = {};
+    }
+    else {
+        auto &leaf{ dir->leaf[slot] };
+        note_dirty(addr & ~0xfffull);
+        leaf->page[(addr >> 12) % PT_FANOUT] = {};
+        if (--leaf->used)
+            return;
+        leaf.reset();
+    }
+    if (--dir->used)
+        return;
+    dir.reset();
+    if (--upper->used)
+        return;
+    upper.reset();
+}
+
+// Permission each kind of TLB entry needs
+static constexpr int TLB_NEED[RvMem::TLB_COUNT]{ RvMem::P_READ, RvMem::P_WRITE, RvMem::P_EXEC };
+
+RvMem::tlb_entry &RvMem::tlb_fill(tlb_kind_t kind, uint64_t addr)
+{
+    tlb_stat[kind].miss++;
+    auto page{ find_or_grow(addr, kind == TLB_WRITE) };
+    if (!page || !(page->perm & TLB_NEED[kind]))
+        throw RvAccVio(addr);
+    if (kind == TLB_WRITE) {
+        if (page->cow)
+            break_cow(*page);
+        // Clean pages never have write entries, so only the first write gets here
+        mark_dirty(*page, addr);
+    }
+    auto &entry{ tlb[kind][(addr >> 12) & (TLB_SIZE - 1)] };
+    entry = { addr >> 12, host_addr(*page, addr), page };
+    return entry;
+}
+
+void RvMem::break_cow(pg_entry &entry)
+{
+    void *frame{ pool.alloc_frame() };
+    if (!frame)
+        throw std::bad_alloc();
+    std::memcpy(frame, entry.addr, 1 << 12);
+    // Same contents, so decoded code stays valid, only host pointers go stale
+    entry.addr = frame;
+    entry.owned = true;
+    entry.cow = false;
+    flush_tlb();
+}
+
+template <typename F>
+void RvMem::for_each_span(tlb_kind_t kind, uint64_t addr, size_t len, F fn)
+{
+    if (!len)
+        return;
+    // Inclusive, so a range ending at the top of the address space works
+    auto last{ addr + len - 1 };
+    if (last < addr)
+        throw RvAccVio(addr);
+    for (uint64_t page{ addr & ~0xfffull };;) {
+        auto entry{ find_or_grow(std::max(page, addr), kind == TLB_WRITE) };
+        if (!entry || !(entry->perm & TLB_NEED[kind]))
+            throw RvAccVio(std::max(page, addr));
+        page |= (entry->huge ? HUGE_SIZE : 1 << 12) - 1;
+        if (page >= last)
+            break;
+        page++;
+    }
+    while (len) {
+        auto &entry{ tlb_lookup(kind, addr) };
+        // Huge pages are contiguous on the host, one span covers the rest
+        uint64_t span{ entry.entry->huge ? HUGE_SIZE : 1 << 12 };
+        auto chunk{ std::min<uint64_t>(len, span - (addr & (span - 1))) };
+        fn(*entry.entry, entry.host + (addr & 0xfff), chunk);
+        addr += chunk;
+        len -= chunk;
+    }
+}
+
+void RvMem::mark_written(pg_entry &entry, uint64_t addr)
+{
+    if (!entry.cached)
+        return;
+    entry.cached = false;
+    entry.gen = ++gen_counter;
+    // Lift the write protection generation() put on it
+    if (in_flat(addr))
+        flat_protect(addr, entry);
+}
+
+void RvMem::mark_dirty(pg_entry &entry, uint64_t addr)
+{
+    if (entry.dirty)
+        return;
+    entry.dirty = true;
+    note_dirty(page_base(entry, addr));
+    if (in_flat(addr))
+        flat_protect(addr, entry);
+}
+
+std::vector<uint64_t> RvMem::take_dirty()
+{
+    std::vector<uint64_t> pages;
+    std::sort(dirty_pages.begin(), dirty_pages.end());
+    dirty_pages.erase(std::unique(dirty_pages.begin(), dirty_pages.end()), dirty_pages.end());
+    for (auto addr : dirty_pages) {
+        // Covered by a huge page listed before
+        if (pages.size() && pages.back() >= addr)
+            continue;
+        auto entry{ find_page(addr) };
+        uint64_t size{ entry && entry->huge ? HUGE_SIZE : 1 << 12 };
+        for (uint64_t offset{ 0 }; offset < size; offset += 1 << 12)
+            pages.push_back(addr + offset);
+        if (!entry)
+            continue;
+        entry->dirty = false;
+        if (in_flat(addr))
+            flat_protect(addr, *entry);
+    }
+    dirty_pages.clear();
+    keep_dirty_room();
+    // Write entries of the TLB and of the jit must go for writes to be seen
+    flush_tlb();
+    return pages;
+}
+
+void RvMem::read_block(uint64_t addr, void *buf, size_t len)
+{
+    auto out{ static_cast<char *>(buf) };
+    for_each_span(TLB_READ, addr, len, [&](pg_entry &, char *host, uint64_t chunk) {
+        std::memcpy(out, host, chunk);
+        out += chunk;
+    });
+}
+
+void RvMem::write_block(uint64_t addr, const void *buf, size_t len)
+{
+    auto in{ static_cast<const char *>(buf) };
+    for_each_span(TLB_WRITE, addr, len, [&](pg_entry &entry, char *host, uint64_t chunk) {
+        mark_written(entry, addr);
+        std::memcpy(host, in, chunk);
+        in += chunk;
+        addr += chunk;
+    });
+}
+
+void RvMem::fill(uint64_t addr, uint8_t value, size_t len)
+{
+    for_each_span(TLB_WRITE, addr, len, [&](pg_entry &entry, char *host, uint64_t chunk) {
+        mark_written(entry, addr);
+        std::memset(host, value, chunk);
+        addr += chunk;
+    });
 }
 
 uint32_t RvMem::fetch(uint64_t addr)
 {
     if (addr & 1)
         throw RvMisAlign(addr);
-    try {
-        auto &entry = page_table.at(addr >> 12);
-        if (!(entry.perm & P_EXEC))
-            throw RvAccVio(addr);
-        return *reinterpret_cast<uint32_t *>(reinterpret_cast<char *>(entry.addr) + (addr & 0xfff));
+    // Only 2 byte aligned, so an inst may end on the next page
+    if ((addr & 0xfff) > 0x1000 - sizeof(uint32_t)) [[unlikely]] {
+        uint32_t raw;
+        auto out{ reinterpret_cast<char *>(&raw) };
+        for_each_span(TLB_FETCH, addr, sizeof(raw), [&](pg_entry &, char *host, uint64_t chunk) {
+            std::memcpy(out, host, chunk);
+            out += chunk;
+        });
+        return raw;
     }
-    catch (std::out_of_range) {
+    return *reinterpret_cast<uint32_t *>(tlb_lookup(TLB_FETCH, addr).host + (addr & 0xfff));
+}
+
+uint64_t RvMem::generation(uint64_t addr)
+{
+    auto entry{ find_page(addr) };
+    if (!entry || !(entry->perm & P_EXEC))
         throw RvAccVio(addr);
+    if (!entry->cached) {
+        entry->cached = true;
+        // Writes fault from now on, so flat_resume can bump gen
+        if (in_flat(addr) && (entry->perm & P_WRITE))
+            flat_protect(addr, *entry);
+    }
+    return entry->gen;
+}
+
+std::pair<void *, int> RvMem::host_page(uint64_t addr)
+{
+    auto entry{ find_page(addr) };
+    if (!entry)
+        return { nullptr, 0 };
+    return { host_addr(*entry, addr), entry->perm };
+}
+
+void *RvMem::page_pool::new_chunk()
+{
+    void *chunk{ ::operator new(HUGE_SIZE, std::align_val_t{ HUGE_SIZE }, std::nothrow) };
+    if (chunk)
+        chunks.push_back(chunk);
+    return chunk;
+}
+
+void *RvMem::page_pool::alloc_frame()
+{
+    if (!free_frames.empty()) {
+        auto frame{ free_frames.back() };
+        free_frames.pop_back();
+        return frame;
+    }
+    if (bump == bump_end) {
+        bump = static_cast<char *>(new_chunk());
+        if (!bump)
+            return bump_end = nullptr;
+        bump_end = bump + HUGE_SIZE;
+    }
+    auto frame{ bump };
+    bump += 1 << 12;
+    return frame;
+}
+
+void *RvMem::page_pool::alloc_huge()
+{
+    if (!free_huges.empty()) {
+        auto page{ free_huges.back() };
+        free_huges.pop_back();
+        return page;
     }
+    auto page{ new_chunk() };
+    if (page)
+        advise_huge(page);
+    return page;
+}
+
+RvMem::page_pool::~page_pool()
+{
+    for (auto chunk : chunks)
+        ::operator delete(chunk, std::align_val_t{ HUGE_SIZE });
 }
 
 bool RvMem::new_page(uint64_t addr_hint, int perm) {
-    if (page_table.find(addr_hint >> 12) != page_table.end())
-        return false;
-    void *buf = ::malloc(1 << 12);
+    if (in_flat(addr_hint)) {
+        // Released region pages read as zero
+        auto entry{ insert_page(addr_hint, false) };
+        if (!entry)
+            return false;
+        *entry = { flat_base + (addr_hint & ~0xfffull), perm, gen_counter, false, false };
+        flat_protect(addr_hint, *entry);
+        return true;
+    }
+    void *buf = pool.alloc_frame();
     if (!buf)
         return false;
-    owned_page.insert(buf);
-    return map_page(addr_hint, perm, buf);
+    auto entry{ insert_page(addr_hint, false) };
+    if (!entry) {
+        pool.free_frame(buf);
+        return false;
+    }
+    *entry = { buf, perm, gen_counter, false, false, true };
+    return true;
 }
 
 bool RvMem::map_page(uint64_t addr_hint, int perm, void *phy_addr) {
-    if (page_table.find(addr_hint >> 12) != page_table.end())
+    auto entry{ insert_page(addr_hint, false) };
+    if (!entry)
         return false;
-    page_table.insert({ addr_hint >> 12, {phy_addr, perm} });
+    if (in_flat(addr_hint)) {
+        // The region is the only copy the guest sees
+        *entry = { flat_base + (addr_hint & ~0xfffull), P_WRITE, gen_counter, false, false };
+        flat_protect(addr_hint, *entry);
+        std::memcpy(entry->addr, phy_addr, 1 << 12);
+        entry->perm = perm;
+        flat_protect(addr_hint, *entry);
+    }
+    else {
+        *entry = { phy_addr, perm, gen_counter, false, false };
+    }
     return true;
 }
 
-bool RvMem::delete_page(uint64_t addr) {
-    if (page_table.find(addr >> 12) == page_table.end())
+bool RvMem::map_cow_page(uint64_t addr_hint, int perm, const void *phy_addr) {
+    // Region pages are copies anyway
+    if (in_flat(addr_hint) || !(perm & P_WRITE))
+        return map_page(addr_hint, perm, const_cast<void *>(phy_addr));
+    auto entry{ insert_page(addr_hint, false) };
+    if (!entry)
         return false;
-    if (owned_page.find(page_table[addr >> 12].addr) == owned_page.end())
+    *entry = { const_cast<void *>(phy_addr), perm, gen_counter, false, false, false, true };
+    return true;
+}
+
+void RvMem::reserve(uint64_t start, uint64_t end, int perm)
+{
+    regions.push_back({ start & ~0xfffull, end, perm });
+    // The fault handler maps pages here, everything it needs is made now
+    auto flat_end{ std::min(end, flat_size) };
+    for (uint64_t addr{ start & ~(HUGE_SIZE - 1) }; addr < flat_end; addr += HUGE_SIZE)
+        pin_table(addr);
+    if (start < flat_end) {
+        dirty_room += ((flat_end - (start & ~0xfffull)) + 0xfff) >> 12;
+        keep_dirty_room();
+        // The first access of a page here may be the read it must refuse
+        if (!(perm & P_READ))
+            flat_unreadable = true;
+    }
+}
+
+void RvMem::pin_table(uint64_t addr)
+{
+    auto &upper{ page_table[addr >> 39] };
+    if (!upper)
+        upper = std::make_unique<pt_upper>();
+    auto &dir{ upper->dir[(addr >> 30) % PT_FANOUT] };
+    if (!dir) {
+        dir = std::make_unique<pt_dir>();
+        upper->used++;
+    }
+    auto slot{ (addr >> 21) % PT_FANOUT };
+    if (dir->huge[slot].addr)
+        return;
+    auto &leaf{ dir->leaf[slot] };
+    if (!leaf) {
+        leaf = std::make_unique<pt_leaf>();
+        dir->used++;
+    }
+    // Counts as a page that's never unmapped, so the leaf stays
+    leaf->used++;
+}
+
+void RvMem::note_dirty(uint64_t page)
+{
+    dirty_pages.push_back(page);
+    if (!in_fault)
+        keep_dirty_room();
+}
+
+void RvMem::keep_dirty_room()
+{
+    if (dirty_pages.capacity() - dirty_pages.size() < dirty_room)
+        dirty_pages.reserve(std::max(dirty_pages.capacity() * 2, dirty_pages.size() + dirty_room));
+}
+
+bool RvMem::new_huge_page(uint64_t addr_hint, int perm) {
+    addr_hint &= ~(HUGE_SIZE - 1);
+    if (in_flat(addr_hint)) {
+        auto entry{ insert_page(addr_hint, true) };
+        if (!entry)
+            return false;
+        *entry = { flat_base + addr_hint, perm, gen_counter, false, true };
+        advise_huge(entry->addr);
+        flat_protect(addr_hint, *entry);
+        return true;
+    }
+    void *buf = pool.alloc_huge();
+    if (!buf)
+        return false;
+    auto entry{ insert_page(addr_hint, true) };
+    if (!entry) {
+        pool.free_huge(buf);
         return false;
-    ::free(page_table[addr >> 12].addr);
-    owned_page.erase(page_table[addr >> 12].addr);
-    page_table.erase(addr >> 12);
+    }
+    *entry = { buf, perm, gen_counter, false, true, true };
     return true;
 }
 
-bool RvMem::unmap_page(uint64_t addr) {
-    if (page_table.find(addr >> 12) == page_table.end())
+bool RvMem::map_huge_page(uint64_t addr_hint, int perm, void *phy_addr) {
+    addr_hint &= ~(HUGE_SIZE - 1);
+    auto entry{ insert_page(addr_hint, true) };
+    if (!entry)
         return false;
-    page_table.erase(addr >> 12);
+    if (in_flat(addr_hint)) {
+        *entry = { flat_base + addr_hint, P_WRITE, gen_counter, false, true };
+        advise_huge(entry->addr);
+        flat_protect(addr_hint, *entry);
+        std::memcpy(entry->addr, phy_addr, HUGE_SIZE);
+        entry->perm = perm;
+        flat_protect(addr_hint, *entry);
+    }
+    else {
+        *entry = { phy_addr, perm, gen_counter, false, true };
+    }
     return true;
 }
 
-RvMem::MemWrapper RvMem::operator[](uint64_t addr)
-{
-    if (page_table.find(addr >> 12) == page_table.end())
-        throw RvAccVio(0);
-    auto &entry{ page_table[addr >> 12] };
-    return MemWrapper(reinterpret_cast<char *>(entry.addr) + (addr & 0xfff), entry.perm);
+bool RvMem::delete_page(uint64_t addr) {
+    auto entry{ find_page(addr) };
+    if (!entry)
+        return false;
+    if (in_flat(addr)) {
+        flat_release(addr, *entry);
+    }
+    else {
+        if (!entry->owned)
+            return false;
+        if (entry->huge)
+            pool.free_huge(entry->addr);
+        else
+            pool.free_frame(entry->addr);
+    }
+    erase_page(addr);
+    ++gen_counter;
+    flush_tlb();
+    return true;
+}
+
+bool RvMem::unmap_page(uint64_t addr) {
+    auto entry{ find_page(addr) };
+    if (!entry)
+        return false;
+    if (in_flat(addr))
+        flat_release(addr, *entry);
+    erase_page(addr);
+    ++gen_counter;
+    flush_tlb();
+    return true;
 }
 
 // Return last memory access time
@@ -71,6 +673,13 @@ uint64_t RvMem::mem_cycle()
 
 RvMem::~RvMem()
 {
-    for (void *i : owned_page)
-        ::free(i);
+#ifdef RV_MEM_FLAT
+    if (!flat_base)
+        return;
+    for (auto &slot : flat_mems) {
+        RvMem *expected{ this };
+        slot.compare_exchange_strong(expected, nullptr, std::memory_order_release);
+    }
+    ::munmap(flat_base, FLAT_SIZE);
+#endif
 }
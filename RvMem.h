@@ -1,9 +1,12 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <map>
-#include <set>
+#include <memory>
+#include <vector>
 #include <concepts>
+#include <utility>
 
 #include "RvExcept.hpp"
 
@@ -11,9 +14,163 @@ class RvMem {
     struct pg_entry {
         void *addr;
         int perm;
+        // Bumped on remap and on writes while cached is set
+        uint64_t gen;
+        // Some cache holds code decoded from this page, set whenever gen is read
+        bool cached;
+        // Maps HUGE_SIZE bytes, only directory slots hold these
+        bool huge;
+        // addr came from the pool
+        bool owned;
+        // addr is shared and read only, the first write makes a private copy
+        bool cow;
+        // Written, or mapped, since the last take_dirty. Pages are only
+        // writable through the TLB or the flat region while set
+        bool dirty{ true };
     };
-    std::map<uint64_t, pg_entry> page_table;
-    std::set<void *> owned_page;
+public:
+    // Guest addresses the page table covers
+    static constexpr unsigned ADDR_BITS{ 48 };
+    static constexpr uint64_t HUGE_SIZE{ uint64_t{ 1 } << 21 };
+private:
+    // Radix page table, 9 bits of the address per level like Sv48. An entry
+    // is in use while addr is set, nodes are freed when their last one goes
+    static constexpr size_t PT_FANOUT{ 512 };
+    // 4 KiB entries of one 2 MiB span
+    struct pt_leaf {
+        std::array<pg_entry, PT_FANOUT> page{};
+        size_t used{};
+    };
+    // One 1 GiB span, each 2 MiB slot is either a huge entry or a leaf
+    struct pt_dir {
+        std::array<pg_entry, PT_FANOUT> huge{};
+        std::array<std::unique_ptr<pt_leaf>, PT_FANOUT> leaf{};
+        size_t used{};
+    };
+    struct pt_upper {
+        std::array<std::unique_ptr<pt_dir>, PT_FANOUT> dir{};
+        size_t used{};
+    };
+    std::array<std::unique_ptr<pt_upper>, PT_FANOUT> page_table;
+    // Entry mapping addr, nullptr if unmapped
+    pg_entry *find_page(uint64_t addr);
+    // Unused entry for a new mapping at addr, nullptr if it would overlap one.
+    // The caller fills it in, leaving it dirty. New mappings take the current
+    // generation without a bump: unmapping moved it past any page that was
+    // there before, and no cache or TLB entry can refer to an empty slot
+    pg_entry *insert_page(uint64_t addr, bool huge);
+    // addr must be mapped
+    void erase_page(uint64_t addr);
+    // Pages whose dirty flag was set, or that were unmapped, since take_dirty
+    std::vector<uint64_t> dirty_pages;
+    void mark_dirty(pg_entry &entry, uint64_t addr);
+    // Pages the fault handler may add to dirty_pages before anything else
+    // runs: one per page mapped in the flat region, and one per page reserved
+    // there. Room for them is kept, so the handler never allocates
+    uint64_t dirty_room{};
+    // Set while the fault handler runs
+    bool in_fault{};
+    void note_dirty(uint64_t page);
+    void keep_dirty_room();
+    // Make the table nodes for the 2 MiB span at addr and keep them, so
+    // the fault handler can map pages there without allocating
+    void pin_table(uint64_t addr);
+    // Host address of the 4 KiB page containing addr
+    static char *host_addr(const pg_entry &entry, uint64_t addr)
+    {
+        return static_cast<char *>(entry.addr) + (entry.huge ? addr & (HUGE_SIZE - 1) & ~0xfffull : 0);
+    }
+    // 4 KiB frames and huge pages carved out of HUGE_SIZE chunks. Freed ones
+    // are reused, chunks only go back to the host with the pool
+    class page_pool {
+        std::vector<void *> chunks;
+        std::vector<void *> free_frames;
+        std::vector<void *> free_huges;
+        // Unused part of the chunk frames are taken from
+        char *bump;
+        char *bump_end;
+        void *new_chunk();
+        page_pool(const page_pool &) = delete;
+        page_pool &operator=(const page_pool &) = delete;
+    public:
+        page_pool() : bump{}, bump_end{} {}
+        // nullptr if the host is out of memory
+        void *alloc_frame();
+        void *alloc_huge();
+        void free_frame(void *frame) { free_frames.push_back(frame); }
+        void free_huge(void *page) { free_huges.push_back(page); }
+        ~page_pool();
+    };
+    page_pool pool;
+    // Ranges whose pages are mapped on first access
+    struct region_t {
+        uint64_t start;
+        uint64_t end;
+        int perm;
+    };
+    std::vector<region_t> regions;
+    // Entry mapping addr, a zeroed page is mapped first if it's unmapped but
+    // reserved. Reads map a shared zero page copied on the first write
+    // instead. nullptr if it stays unmapped
+    pg_entry *find_or_grow(uint64_t addr, bool write);
+    uint64_t gen_counter;
+    // Flat mode, guest [0, flat_size) is one host region and pages mapped in
+    // it are guarded by the host MMU. flat_size is 0 otherwise
+    char *flat_base;
+    uint64_t flat_size;
+    // Set once a page of the region is mapped without P_READ. The host can't
+    // tell reads from fetches, so reads then check permissions through the TLB
+    bool flat_unreadable;
+    friend struct RvMemFaultHandler;
+    bool in_flat(uint64_t addr) const { return addr < flat_size; }
+    void flat_protect(uint64_t addr, const pg_entry &entry);
+    void flat_release(uint64_t addr, const pg_entry &entry);
+    // Resume an access to a page only protected for its cached code, or to
+    // a reserved page not mapped yet
+    bool flat_resume(uint64_t addr);
+public:
+    enum tlb_kind_t { TLB_READ, TLB_WRITE, TLB_FETCH, TLB_COUNT };
+    struct tlb_stat_t {
+        uint64_t hit;
+        uint64_t miss;
+    };
+    static constexpr size_t TLB_SIZE{ 64 };
+private:
+    // Direct mapped, entries only hold pages allowing their kind of access.
+    // Page entries live in table nodes, so pointers stay valid until unmapped
+    struct tlb_entry {
+        uint64_t vpn;
+        char *host;
+        pg_entry *entry;
+    };
+    std::array<std::array<tlb_entry, TLB_SIZE>, TLB_COUNT> tlb;
+    std::array<tlb_stat_t, TLB_COUNT> tlb_stat;
+    // Moved by every flush, so TLBs outside RvMem know to flush too
+    uint64_t tlb_epoch;
+    void flush_tlb();
+    // Walk the page table on a miss, throws RvAccVio if kind isn't allowed
+    tlb_entry &tlb_fill(tlb_kind_t kind, uint64_t addr);
+    // Give a copy-on-write page its private copy
+    void break_cow(pg_entry &entry);
+    // Calls fn(entry, host, len) for each page span of [addr, addr + len),
+    // once the whole range is known to allow kind
+    template <typename F>
+    void for_each_span(tlb_kind_t kind, uint64_t addr, size_t len, F fn);
+    // Generation bump of a write to a page that may hold cached code
+    void mark_written(pg_entry &entry, uint64_t addr);
+    // Base of the page entry maps
+    static uint64_t page_base(const pg_entry &entry, uint64_t addr)
+    {
+        return addr & ~((entry.huge ? HUGE_SIZE : 1 << 12) - 1);
+    }
+    tlb_entry &tlb_lookup(tlb_kind_t kind, uint64_t addr)
+    {
+        auto &entry{ tlb[kind][(addr >> 12) & (TLB_SIZE - 1)] };
+        if (entry.vpn != addr >> 12) [[unlikely]]
+            return tlb_fill(kind, addr);
+        tlb_stat[kind].hit++;
+        return entry;
+    }
     RvMem(const RvMem &) = delete;
     RvMem(RvMem &&) = delete;
     RvMem &operator=(const RvMem &) = delete;
@@ -24,13 +181,14 @@ public:
         P_WRITE = 2,
         P_EXEC = 4
     };
+    // Accesses go through the TLB once the wrapper is read or assigned
     class MemWrapper {
         friend class RvMem;
-        void *data;
-        int perm;
-        MemWrapper(void *data, int perm)
-            : data{ data }
-            , perm{ perm }
+        RvMem &owner;
+        uint64_t addr;
+        MemWrapper(RvMem &owner, uint64_t addr)
+            : owner{ owner }
+            , addr{ addr }
         {
             return;
         }
@@ -40,31 +198,125 @@ public:
         MemWrapper &operator=(MemWrapper &&) = delete;
     public:
         template<std::integral T>
-        T &operator=(T data) 
+        T operator=(T data)
         {
-            if (!(perm & P_WRITE))
-                throw RvAccVio(0);
-            return *reinterpret_cast<T *>(this->data) = data;
+            owner.write<T>(addr, data);
+            return data;
         }
         template <std::integral T>
         operator T()
         {
-            if (!(perm & P_READ))
-                throw RvAccVio(0);
-            return *reinterpret_cast<T *>(this->data);
+            return owner.read<T>(addr);
         }
     };
-    RvMem();
+    // Guest addresses a flat memory covers
+    static constexpr uint64_t FLAT_SIZE{ uint64_t{ 1 } << 32 };
+    // A flat memory falls back to the page table if the host can't reserve it
+    explicit RvMem(bool flat = false);
+    bool is_flat() const { return flat_size != 0; }
+    template <std::integral T>
+    T read(uint64_t addr)
+    {
+        // Host faults in the region are thrown as RvAccVio
+        if (in_flat(addr) && !flat_unreadable)
+            return *reinterpret_cast<T *>(flat_base + addr);
+        if ((addr & 0xfff) > 0x1000 - sizeof(T)) [[unlikely]] {
+            T data;
+            read_block(addr, &data, sizeof(T));
+            return data;
+        }
+        return *reinterpret_cast<T *>(tlb_lookup(TLB_READ, addr).host + (addr & 0xfff));
+    }
+    template <std::integral T>
+    void write(uint64_t addr, T data)
+    {
+        // Pages with cached code are write protected, see flat_resume
+        if (in_flat(addr)) {
+            *reinterpret_cast<T *>(flat_base + addr) = data;
+            return;
+        }
+        if ((addr & 0xfff) > 0x1000 - sizeof(T)) [[unlikely]] {
+            write_block(addr, &data, sizeof(T));
+            return;
+        }
+        auto &entry{ tlb_lookup(TLB_WRITE, addr) };
+        // Stale decoded instructions are detected by generation, pages
+        // no cache has read since the last bump take writes for free
+        if (entry.entry->cached) {
+            entry.entry->cached = false;
+            entry.entry->gen = ++gen_counter;
+        }
+        *reinterpret_cast<T *>(entry.host + (addr & 0xfff)) = data;
+    }
+    // Bulk accesses, spans may cross pages and each page is resolved once.
+    // The whole range is checked first, a fault leaves guest memory and buf
+    // untouched and reports the lowest address that isn't accessible
+    void read_block(uint64_t addr, void *buf, size_t len);
+    void write_block(uint64_t addr, const void *buf, size_t len);
+    void fill(uint64_t addr, uint8_t value, size_t len);
     uint32_t fetch(uint64_t addr);
+    // Generation of the executable page at addr, changes when it's remapped or
+    // written. Callers cache code against it, so the page is tracked from now on
+    uint64_t generation(uint64_t addr);
+    // Latest generation of all pages, changes on any remap, unmap or code write
+    const uint64_t &code_generation() const { return gen_counter; }
+    // Changes whenever a host pointer taken from a TLB may have gone stale,
+    // or writes to clean pages must fault again. Code is unaffected
+    const uint64_t &tlb_generation() const { return tlb_epoch; }
+    // Host address and permission of the page containing addr, {nullptr, 0} if unmapped
+    std::pair<void *, int> host_page(uint64_t addr);
+    // fn(addr, host, size, perm) for every mapped page in address order, size
+    // is HUGE_SIZE for huge pages. Only the page table is walked, reserved
+    // pages that were never touched aren't mapped yet
+    template <typename F>
+    void for_each_page(F fn) const
+    {
+        for (size_t i{ 0 }; i < PT_FANOUT; i++) {
+            if (!page_table[i])
+                continue;
+            for (size_t j{ 0 }; j < PT_FANOUT; j++) {
+                auto &dir{ page_table[i]->dir[j] };
+                if (!dir)
+                    continue;
+                for (size_t k{ 0 }; k < PT_FANOUT; k++) {
+                    uint64_t base{ (uint64_t{ i } << 39) | (uint64_t{ j } << 30) | (uint64_t{ k } << 21) };
+                    if (auto &huge{ dir->huge[k] }; huge.addr) {
+                        fn(base, static_cast<const char *>(huge.addr), HUGE_SIZE, huge.perm);
+                        continue;
+                    }
+                    if (!dir->leaf[k])
+                        continue;
+                    for (size_t m{ 0 }; m < PT_FANOUT; m++)
+                        if (auto &page{ dir->leaf[k]->page[m] }; page.addr)
+                            fn(base | (m << 12), static_cast<const char *>(page.addr), uint64_t{ 1 } << 12, page.perm);
+                }
+            }
+        }
+    }
     // RvMem owns the newly allocated page
     bool new_page(uint64_t addr_hint, int perm);
-    // RvMem doesn't own the page
+    // RvMem doesn't own the page, unless it's copied into a flat region
     bool map_page(uint64_t addr_hint, int perm, void *phy_addr);
-    // remove mapping and delete
+    // Map phy_addr until the guest first writes to the page, which then gets
+    // a private copy. RvMem doesn't own phy_addr and never writes to it
+    bool map_cow_page(uint64_t addr_hint, int perm, const void *phy_addr);
+    // Pages of [start, end) are mapped with perm, zeroed, when first accessed.
+    // Pages mapped already are left alone
+    void reserve(uint64_t start, uint64_t end, int perm);
+    // 2 MiB versions, addr_hint is rounded down to HUGE_SIZE. Owned huge
+    // pages are backed by transparent huge pages where the host has them
+    bool new_huge_page(uint64_t addr_hint, int perm);
+    bool map_huge_page(uint64_t addr_hint, int perm, void *phy_addr);
+    // remove mapping and delete, a huge page goes as a whole
     bool delete_page(uint64_t addr);
-    // just unmap
+    // just unmap, a huge page goes as a whole
     bool unmap_page(uint64_t addr);
-    MemWrapper operator[](uint64_t addr);
+    // 4 KiB pages written, mapped or unmapped since the last call, sorted, and
+    // clean them so later writes are tracked again. Huge pages are listed
+    // page by page. Counts as a remap, so code generations move
+    std::vector<uint64_t> take_dirty();
+    MemWrapper operator[](uint64_t addr) { return MemWrapper(*this, addr); }
+    const std::array<tlb_stat_t, TLB_COUNT> &get_tlb_stat() const { return tlb_stat; }
     virtual uint64_t mem_cycle();
     ~RvMem();
 };
@@ -0,0 +1,217 @@
+#include "RvMemDump.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+namespace {
+
+// Zero runs are found a cache line at a time, and shorter ones than this are
+// kept in the data around them
+constexpr uint64_t LINE{ 64 };
+constexpr uint64_t MIN_ZERO_RUN{ 4 * LINE };
+constexpr uint64_t ZERO_TOKEN{ uint64_t{ 1 } << 31 };
+constexpr uint64_t MAX_TOKEN{ ZERO_TOKEN - 1 };
+
+bool is_zero_line(const char *line)
+{
+    uint64_t acc{};
+    for (uint64_t i{ 0 }; i < LINE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, line + i, sizeof(word));
+        acc |= word;
+    }
+    return !acc;
+}
+
+template <typename T>
+bool get(std::istream &in, T &value)
+{
+    char bytes[sizeof(T)];
+    if (!in.read(bytes, sizeof(T)))
+        return false;
+    uint64_t result{};
+    for (size_t i{ 0 }; i < sizeof(T); i++)
+        result |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (i * 8);
+    value = static_cast<T>(result);
+    return true;
+}
+
+template <typename T>
+void put(std::ostream &out, T value)
+{
+    char bytes[sizeof(T)];
+    for (size_t i{ 0 }; i < sizeof(T); i++)
+        bytes[i] = static_cast<char>(static_cast<uint64_t>(value) >> (i * 8));
+    out.write(bytes, sizeof(T));
+}
+
+class dump_writer {
+    struct extent_t {
+        uint64_t start;
+        uint64_t length;
+        int perm;
+        uint64_t offset;
+        uint64_t encoded;
+    };
+    std::ostream &out;
+    std::vector<extent_t> index;
+    uint64_t pos;
+    // Zeros not written yet, runs continue across pages of an extent
+    uint64_t zeros;
+    void flush_zeros()
+    {
+        for (; zeros; ) {
+            auto run{ std::min(zeros, MAX_TOKEN) };
+            put<uint32_t>(out, static_cast<uint32_t>(ZERO_TOKEN | run));
+            pos += 4;
+            zeros -= run;
+        }
+    }
+    void data(const char *host, uint64_t len)
+    {
+        if (!len)
+            return;
+        flush_zeros();
+        put<uint32_t>(out, static_cast<uint32_t>(len));
+        out.write(host, len);
+        pos += 4 + len;
+    }
+    void close_extent()
+    {
+        if (index.empty())
+            return;
+        flush_zeros();
+        index.back().encoded = pos - index.back().offset;
+    }
+public:
+    explicit dump_writer(std::ostream &out)
+        : out{ out }
+        , pos{ 8 }
+        , zeros{}
+    {
+        out.write("RVMD", 4);
+        put<uint32_t>(out, RV_MEM_DUMP_VERSION);
+    }
+    void page(uint64_t addr, const char *host, uint64_t size, int perm)
+    {
+        if (index.empty() || index.back().start + index.back().length != addr || index.back().perm != perm) {
+            close_extent();
+            index.push_back({ addr, 0, perm, pos, 0 });
+        }
+        index.back().length += size;
+        // Pages without any access may not be readable on the host
+        if (!perm) {
+            zeros += size;
+            return;
+        }
+        // Data goes straight from guest memory, pages are contiguous on the host
+        uint64_t start{ 0 };
+        for (uint64_t line{ 0 }; line < size; ) {
+            if (!is_zero_line(host + line)) {
+                line += LINE;
+                continue;
+            }
+            auto run_end{ line + LINE };
+            while (run_end < size && is_zero_line(host + run_end))
+                run_end += LINE;
+            // Runs at either end of the data may join zeros of the next page or the last one
+            if (run_end - line >= MIN_ZERO_RUN || line == start || run_end == size) {
+                data(host + start, line - start);
+                zeros += run_end - line;
+                start = run_end;
+            }
+            line = run_end;
+        }
+        data(host + start, size - start);
+    }
+    void finish()
+    {
+        close_extent();
+        auto index_pos{ pos };
+        for (auto &extent : index) {
+            put<uint64_t>(out, extent.start);
+            put<uint64_t>(out, extent.length);
+            put<uint32_t>(out, static_cast<uint32_t>(extent.perm));
+            put<uint64_t>(out, extent.offset);
+            put<uint64_t>(out, extent.encoded);
+        }
+        put<uint64_t>(out, index_pos);
+        put<uint64_t>(out, index.size());
+        out.write("RVMD", 4);
+    }
+};
+
+}
+
+bool rv_mem_dump(const RvMem &mem, const std::string &path)
+{
+    // Large writes bypass the buffer, it only gathers tokens and short data
+    constexpr size_t BUFFER_SIZE{ 1 << 20 };
+    auto buffer{ std::make_unique<char[]>(BUFFER_SIZE) };
+    std::ofstream out;
+    out.rdbuf()->pubsetbuf(buffer.get(), BUFFER_SIZE);
+    out.open(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    dump_writer writer(out);
+    mem.for_each_page([&](uint64_t addr, const char *host, uint64_t size, int perm) {
+        writer.page(addr, host, size, perm);
+    });
+    writer.finish();
+    out.close();
+    return static_cast<bool>(out);
+}
+
+bool rv_mem_undump(const std::string &path, const std::function<void(uint64_t addr, int perm, const char *page)> &fn)
+{
+    std::ifstream in(path, std::ios::binary);
+    char magic[4];
+    uint32_t version;
+    uint64_t index_pos, count;
+    if (!in.read(magic, 4) || std::memcmp(magic, "RVMD", 4) || !get(in, version) || version != RV_MEM_DUMP_VERSION)
+        return false;
+    if (!in.seekg(-20, std::ios::end) || !get(in, index_pos) || !get(in, count))
+        return false;
+    std::vector<char> page(1 << 12);
+    for (uint64_t i{ 0 }; i < count; i++) {
+        uint64_t start, length, offset, encoded;
+        uint32_t perm;
+        if (!in.seekg(index_pos + i * 36) || !get(in, start) || !get(in, length) || !get(in, perm) || !get(in, offset) || !get(in, encoded))
+            return false;
+        if (!in.seekg(offset))
+            return false;
+        // Tokens don't stop at pages, fill one and hand it out whenever it's full
+        uint64_t done{ 0 }, filled{ 0 }, read{ 0 };
+        while (read < encoded) {
+            uint32_t token;
+            if (!get(in, token))
+                return false;
+            read += 4;
+            uint64_t len{ token & MAX_TOKEN };
+            if (!(token & ZERO_TOKEN))
+                read += len;
+            if (done + filled + len > length)
+                return false;
+            while (len) {
+                auto chunk{ std::min(len, (1 << 12) - filled) };
+                if (token & ZERO_TOKEN)
+                    std::memset(page.data() + filled, 0, chunk);
+                else if (!in.read(page.data() + filled, chunk))
+                    return false;
+                filled += chunk;
+                len -= chunk;
+                if (filled == 1 << 12) {
+                    fn(start + done, perm, page.data());
+                    done += filled;
+                    filled = 0;
+                }
+            }
+        }
+        if (read != encoded || done != length || filled)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "RvMem.h"
+
+// Sparse image of guest memory, written as the page table is walked, so
+// nothing but the index is held in memory. The file is
+//   "RVMD", version (u32)
+//   the contents of each extent, one after another
+//   the index, per extent: start, length (u64), perm (u32), offset and
+//   length of its contents in the file (u64)
+//   index offset, extent count (u64), "RVMD"
+// all little endian. An extent is a run of mapped pages with the same
+// permission. Its contents are a sequence of u32 tokens, one with the top
+// bit set stands for that many zero bytes, one without is followed by that
+// many bytes of data.
+constexpr uint32_t RV_MEM_DUMP_VERSION{ 1 };
+
+// false if path can't be written
+bool rv_mem_dump(const RvMem &mem, const std::string &path);
+// fn(addr, perm, page) for every 4 KiB page of the image at path, in address
+// order, decoded one page at a time. false if it can't be read or is malformed
+bool rv_mem_undump(const std::string &path, const std::function<void(uint64_t addr, int perm, const char *page)> &fn);
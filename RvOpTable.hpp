@@ -0,0 +1,204 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+
+#include "RvExcept.hpp"
+#include "RvInst.h"
+
+// Semantics and encodings of RV64IM ops, shared by the decoder and the execution engines
+
+// funct7 values of RV64IM, -1 if illegal
+constexpr int funct7_index(uint8_t funct7) {
+    switch (funct7) {
+    case 0x00:
+        return 0;
+    case 0x01:
+        return 1;
+    case 0x20:
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+#ifdef _MSC_VER
+#include <__msvc_int128.hpp>
+inline uint64_t imull(uint64_t s1, uint64_t s2) {
+    std::_Signed128 result = s1;
+    result *= s2;
+    return static_cast<uint64_t>(result);
+}
+inline uint64_t imulh(uint64_t s1, uint64_t s2) {
+    std::_Signed128 result = s1;
+    result *= s2;
+    result >>= 64;
+    return static_cast<uint64_t>(result);
+}
+#endif
+
+#ifdef __GNUC__
+inline uint64_t imull(uint64_t s1, uint64_t s2) {
+    __int128_t result = s1;
+    result *= s2;
+    return result;
+}
+inline uint64_t imulh(uint64_t s1, uint64_t s2) {
+    __int128_t result = s1;
+    result *= s2;
+    return result >> 64;
+}
+#endif
+
+struct RvRInstOp {
+    const char *name;
+    RvOp op;
+    uint64_t (*fn)(uint64_t, uint64_t);
+    uint64_t cycles;
+};
+
+// Indexed by [opcode == 0x3b][funct3][funct7_index(funct7)], unnamed entries are illegal
+inline constexpr auto RvRInstOpTable{ [] {
+    std::array<std::array<std::array<RvRInstOp, 3>, 8>, 2> table{};
+    auto &op{ table[0] };
+    op[0x00][0] = { "add", RvOp::ADD, [](uint64_t s1, uint64_t s2) { return s1 + s2; }, 1 };
+    op[0x00][1] = { "mul", RvOp::MUL, imull, 2 };
+    op[0x00][2] = { "sub", RvOp::SUB, [](uint64_t s1, uint64_t s2) { return s1 - s2; }, 1 };
+    op[0x01][0] = { "sll", RvOp::SLL, [](uint64_t s1, uint64_t s2) { return s1 << s2; }, 1 };
+    op[0x01][1] = { "mulh", RvOp::MULH, imulh, 2 };
+    op[0x02][0] = { "slt", RvOp::SLT, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) < std::bit_cast<int64_t>(s2) ? 1 : 0; }, 1 };
+    op[0x03][0] = { "sltu", RvOp::SLTU, [](uint64_t s1, uint64_t s2) -> uint64_t { return s1 < s2 ? 1 : 0; }, 1 };
+    op[0x04][0] = { "xor", RvOp::XOR, [](uint64_t s1, uint64_t s2) { return s1 ^ s2; }, 1 };
+    op[0x04][1] = { "div", RvOp::DIV, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) / std::bit_cast<int64_t>(s2); }, 40 };
+    op[0x05][0] = { "srl", RvOp::SRL, [](uint64_t s1, uint64_t s2) { return s1 >> s2; }, 1 };
+    op[0x05][1] = { "divu", RvOp::DIVU, [](uint64_t s1, uint64_t s2) { return s1 / s2; }, 40 };
+    op[0x05][2] = { "sra", RvOp::SRA, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) >> std::bit_cast<int64_t>(s2); }, 1 };
+    op[0x06][0] = { "or", RvOp::OR, [](uint64_t s1, uint64_t s2) { return s1 | s2; }, 1 };
+    op[0x06][1] = { "rem", RvOp::REM, [](uint64_t s1, uint64_t s2) -> uint64_t { return std::bit_cast<int64_t>(s1) % std::bit_cast<int64_t>(s2); }, 40 };
+    op[0x07][0] = { "and", RvOp::AND, [](uint64_t s1, uint64_t s2) { return s1 & s2; }, 1 };
+    op[0x07][1] = { "remu", RvOp::REMU, [](uint64_t s1, uint64_t s2) { return s1 % s2; }, 40 };
+    auto &opw{ table[1] };
+    opw[0x00][0] = { "addw", RvOp::ADDW, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1 + s2)); }, 1 };
+    opw[0x00][1] = { "mulw", RvOp::MULW, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) * static_cast<int32_t>(s2)); }, 1 };
+    opw[0x00][2] = { "subw", RvOp::SUBW, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1 - s2)); }, 1 };
+    opw[0x04][1] = { "divw", RvOp::DIVW, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) / static_cast<int32_t>(s2)); }, 40 };
+    opw[0x06][1] = { "remw", RvOp::REMW, [](uint64_t s1, uint64_t s2) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s1) % static_cast<int32_t>(s2)); }, 40 };
+    return table;
+}() };
+
+struct RvIInstOp {
+    const char *name;
+    RvOp op;
+    uint64_t (*fn)(int64_t, int64_t);
+    // Loads only
+    size_t width;
+    bool sign;
+};
+
+// Opcodes of I-type insts, -1 if not I-type
+constexpr int i_opcode_index(uint8_t opcode) {
+    switch (opcode) {
+    case 0x03:
+        return 0;
+    case 0x13:
+        return 1;
+    case 0x1B:
+        return 2;
+    case 0x67:
+        return 3;
+    case 0x73:
+        return 4;
+    default:
+        return -1;
+    }
+}
+
+// Shifts take funct7 and a 6-bit shamt
+constexpr bool i_has_funct7(uint8_t opcode, uint8_t funct3) {
+    return (opcode == 0x13 || opcode == 0x1B) && (funct3 == 0x01 || funct3 == 0x05);
+}
+
+// Indexed by [opcode == 0x1B][funct3][funct7_index(funct7)], unnamed entries are illegal
+inline constexpr auto RvIInstWithF7OpTable{ [] {
+    std::array<std::array<std::array<RvIInstOp, 3>, 8>, 2> table{};
+    auto &op{ table[0] };
+    op[0x01][0] = { "slli", RvOp::SLLI, [](int64_t s, int64_t imm) -> uint64_t { return s << imm; } };
+    op[0x05][0] = { "srli", RvOp::SRLI, [](int64_t s, int64_t imm) { return std::bit_cast<uint64_t>(s) >> imm; } };
+    op[0x05][2] = { "srai", RvOp::SRAI, [](int64_t s, int64_t imm) -> uint64_t { return s >> imm; } };
+    auto &opw{ table[1] };
+    opw[0x01][0] = { "slliw", RvOp::SLLIW, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s) << static_cast<int32_t>(imm)); } };
+    opw[0x05][0] = { "srliw", RvOp::SRLIW, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(static_cast<uint32_t>(s) >> static_cast<uint32_t>(imm))); } };
+    opw[0x05][2] = { "sraiw", RvOp::SRAIW, [](int64_t s, int64_t imm) -> uint64_t { return static_cast<int64_t>(static_cast<int32_t>(s) >> static_cast<int32_t>(imm)); } };
+    return table;
+}() };
+
+// Indexed by [i_opcode_index(opcode)][funct3], unnamed entries are illegal
+inline constexpr auto RvIInstOpTable{ [] {
+    std::array<std::array<RvIInstOp, 8>, 5> table{};
+    auto &load{ table[0] };
+    load[0x00] = { "lb", RvOp::LB, nullptr, 1, true };
+    load[0x01] = { "lh", RvOp::LH, nullptr, 2, true };
+    load[0x02] = { "lw", RvOp::LW, nullptr, 4, true };
+    load[0x03] = { "ld", RvOp::LD, nullptr, 8, true };
+    load[0x04] = { "lbu", RvOp::LBU, nullptr, 1, false };
+    load[0x05] = { "lhu", RvOp::LHU, nullptr, 2, false };
+    load[0x06] = { "lwu", RvOp::LWU, nullptr, 4, false };
+    auto &op{ table[1] };
+    op[0x00] = { "addi", RvOp::ADDI, [](int64_t s, int64_t imm) -> uint64_t { return s + imm; } };
+    op[0x02] = { "slti", RvOp::SLTI, [](int64_t s, int64_t imm) -> uint64_t { return s < imm ? 1 : 0; } };
+    op[0x04] = { "xori", RvOp::XORI, [](int64_t s, int64_t imm) -> uint64_t { return s ^ imm; } };
+    op[0x06] = { "ori", RvOp::ORI, [](int64_t s, int64_t imm) -> uint64_t { return s | imm; } };
+    op[0x07] = { "andi", RvOp::ANDI, [](int64_t s, int64_t imm) -> uint64_t { return s & imm; } };
+    auto &opw{ table[2] };
+    opw[0x00] = { "addiw", RvOp::ADDIW, [](int64_t s, int64_t imm) -> uint64_t { return ((s + imm) << 32) >> 32; } };
+    table[3][0x00] = { "jalr", RvOp::JALR };
+    table[4][0x00] = { "ecall", RvOp::ECALL };
+    return table;
+}() };
+
+struct RvSBInstOp {
+    const char *name;
+    RvOp op;
+    bool (*fn)(int64_t, int64_t);
+};
+
+// Indexed by [funct3], unnamed entries are illegal
+inline constexpr auto RvSBInstOpTable{ [] {
+    std::array<RvSBInstOp, 8> table{};
+    table[0x00] = { "beq", RvOp::BEQ, [](int64_t s1, int64_t s2) { return s1 == s2; } };
+    table[0x01] = { "bne", RvOp::BNE, [](int64_t s1, int64_t s2) { return s1 != s2; } };
+    table[0x04] = { "blt", RvOp::BLT, [](int64_t s1, int64_t s2) { return s1 < s2; } };
+    table[0x05] = { "bge", RvOp::BGE, [](int64_t s1, int64_t s2) { return s1 >= s2; } };
+    table[0x06] = { "bltu", RvOp::BLTU, [](int64_t s1, int64_t s2) { return std::bit_cast<uint64_t>(s1) < std::bit_cast<uint64_t>(s2); } };
+    table[0x07] = { "bgeu", RvOp::BGEU, [](int64_t s1, int64_t s2) { return std::bit_cast<uint64_t>(s1) >= std::bit_cast<uint64_t>(s2); } };
+    return table;
+}() };
+
+// Find table entries of an op at compile time
+constexpr const RvRInstOp &r_entry(RvOp op) {
+    for (auto &table : RvRInstOpTable)
+        for (auto &f3 : table)
+            for (auto &entry : f3)
+                if (entry.name && entry.op == op)
+                    return entry;
+    throw RvIllIns(0);
+}
+constexpr const RvIInstOp &i_entry(RvOp op) {
+    for (auto &table : RvIInstWithF7OpTable)
+        for (auto &f3 : table)
+            for (auto &entry : f3)
+                if (entry.name && entry.op == op)
+                    return entry;
+    for (auto &table : RvIInstOpTable)
+        for (auto &entry : table)
+            if (entry.name && entry.op == op)
+                return entry;
+    throw RvIllIns(0);
+}
+constexpr const RvSBInstOp &sb_entry(RvOp op) {
+    for (auto &entry : RvSBInstOpTable)
+        if (entry.name && entry.op == op)
+            return entry;
+    throw RvIllIns(0);
+}
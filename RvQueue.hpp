@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded lock-free queue for any number of producers and consumers.
+// Each cell carries a sequence number telling whose turn it is, so a
+// push or pop only contends on its own end of the ring.
+template <typename T, size_t N>
+class RvMpmcQueue {
+    static_assert(std::has_single_bit(N));
+    struct cell_t {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    std::array<cell_t, N> cells;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    RvMpmcQueue(const RvMpmcQueue &) = delete;
+    RvMpmcQueue &operator=(const RvMpmcQueue &) = delete;
+public:
+    RvMpmcQueue()
+        : cells{}
+        , head{}
+        , tail{}
+    {
+        for (size_t i{ 0 }; i < N; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    // false if the queue is full
+    bool push(const T &value)
+    {
+        auto pos{ head.load(std::memory_order_relaxed) };
+        for (;;) {
+            auto &cell{ cells[pos & (N - 1)] };
+            auto diff{ static_cast<intptr_t>(cell.seq.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos) };
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = value;
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = head.load(std::memory_order_relaxed);
+        }
+    }
+    // false if the queue is empty
+    bool pop(T &value)
+    {
+        auto pos{ tail.load(std::memory_order_relaxed) };
+        for (;;) {
+            auto &cell{ cells[pos & (N - 1)] };
+            auto diff{ static_cast<intptr_t>(cell.seq.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + 1) };
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.data;
+                    cell.seq.store(pos + N, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+    // Only a snapshot while other threads are at work
+    size_t size() const
+    {
+        auto pushed{ head.load(std::memory_order_relaxed) };
+        auto popped{ tail.load(std::memory_order_relaxed) };
+        return pushed > popped ? pushed - popped : 0;
+    }
+};
@@ -0,0 +1,161 @@
+#include "RvSnapshot.h"
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static bool is_zero(const char *page)
+{
+#ifdef __SSE2__
+    auto p{ reinterpret_cast<const __m128i *>(page) };
+    __m128i acc{ _mm_setzero_si128() };
+    for (size_t i{ 0 }; i < (1 << 12) / sizeof(__m128i); i += 4)
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p + i), _mm_loadu_si128(p + i + 1)),
+            _mm_or_si128(_mm_loadu_si128(p + i + 2), _mm_loadu_si128(p + i + 3))));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#else
+    uint64_t acc{};
+    for (size_t i{ 0 }; i < 1 << 12; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, page + i, sizeof(word));
+        acc |= word;
+    }
+    return !acc;
+#endif
+}
+
+static bool is_same(const char *a, const char *b)
+{
+#ifdef __SSE2__
+    auto pa{ reinterpret_cast<const __m128i *>(a) };
+    auto pb{ reinterpret_cast<const __m128i *>(b) };
+    // Lines differ early if they differ at all, so stop at the first
+    for (size_t i{ 0 }; i < (1 << 12) / sizeof(__m128i); i += 4) {
+        auto eq{ _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa + i), _mm_loadu_si128(pb + i)),
+                _mm_cmpeq_epi8(_mm_loadu_si128(pa + i + 1), _mm_loadu_si128(pb + i + 1))),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa + i + 2), _mm_loadu_si128(pb + i + 2)),
+                _mm_cmpeq_epi8(_mm_loadu_si128(pa + i + 3), _mm_loadu_si128(pb + i + 3)))) };
+        if (_mm_movemask_epi8(eq) != 0xffff)
+            return false;
+    }
+    return true;
+#else
+    return std::memcmp(a, b, 1 << 12) == 0;
+#endif
+}
+
+RvSnapshot::RvSnapshot(RvMem &mem)
+    : mem{ mem }
+    , stat{}
+{
+    return;
+}
+
+RvSnapshot::delta_t RvSnapshot::capture()
+{
+    delta_t delta;
+    stat.captures++;
+    for (auto addr : mem.take_dirty()) {
+        auto [host, perm] { mem.host_page(addr) };
+        auto it{ current.find(addr) };
+        if (!host) {
+            if (it != current.end()) {
+                current.erase(it);
+                delta.pages.push_back({ addr, 0, K_REMOVED, 0 });
+                stat.removed++;
+            }
+            continue;
+        }
+        stat.dirty++;
+        // Pages without any access aren't readable on the host, take them as zeros
+        auto page{ static_cast<const char *>(host) };
+        if (!perm || is_zero(page)) {
+            if (it != current.end() && !it->second.data && it->second.perm == perm) {
+                stat.unchanged++;
+                continue;
+            }
+            current[addr] = { perm, nullptr };
+            delta.pages.push_back({ addr, perm, K_ZERO, 0 });
+            stat.zero++;
+            continue;
+        }
+        if (it == current.end())
+            it = current.emplace(addr, saved_t{ perm, nullptr }).first;
+        auto &saved{ it->second };
+        if (saved.data && saved.perm == perm && is_same(page, saved.data->data())) {
+            stat.unchanged++;
+            continue;
+        }
+        if (!saved.data)
+            saved.data = std::make_unique<page_data>();
+        std::memcpy(saved.data->data(), page, 1 << 12);
+        saved.perm = perm;
+        delta.pages.push_back({ addr, perm, K_DATA, delta.data.size() });
+        delta.data.push_back(*saved.data);
+        stat.copied++;
+    }
+    return delta;
+}
+
+template <typename T>
+static void put(std::ostream &out, T value)
+{
+    char bytes[sizeof(T)];
+    for (size_t i{ 0 }; i < sizeof(T); i++)
+        bytes[i] = static_cast<char>(static_cast<uint64_t>(value) >> (i * 8));
+    out.write(bytes, sizeof(T));
+}
+
+template <typename T>
+static bool get(std::istream &in, T &value)
+{
+    char bytes[sizeof(T)];
+    if (!in.read(bytes, sizeof(T)))
+        return false;
+    uint64_t result{};
+    for (size_t i{ 0 }; i < sizeof(T); i++)
+        result |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (i * 8);
+    value = static_cast<T>(result);
+    return true;
+}
+
+void RvSnapshot::write(const delta_t &delta, std::ostream &out)
+{
+    out.write("RVSN", 4);
+    put<uint64_t>(out, delta.pages.size());
+    for (auto &page : delta.pages) {
+        put<uint64_t>(out, page.addr);
+        put<uint8_t>(out, page.perm);
+        put<uint8_t>(out, page.kind);
+        if (page.kind == K_DATA)
+            out.write(delta.data[page.index].data(), 1 << 12);
+    }
+}
+
+bool RvSnapshot::read(std::istream &in, delta_t &delta)
+{
+    char magic[4];
+    uint64_t count;
+    if (!in.read(magic, 4) || std::memcmp(magic, "RVSN", 4) || !get(in, count))
+        return false;
+    delta = {};
+    for (uint64_t i{ 0 }; i < count; i++) {
+        page_t page{};
+        uint8_t perm, kind;
+        if (!get(in, page.addr) || !get(in, perm) || !get(in, kind) || kind > K_REMOVED)
+            return false;
+        page.perm = perm;
+        page.kind = static_cast<page_kind_t>(kind);
+        if (page.kind == K_DATA) {
+            page.index = delta.data.size();
+            delta.data.emplace_back();
+            if (!in.read(delta.data.back().data(), 1 << 12))
+                return false;
+        }
+        delta.pages.push_back(page);
+    }
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include "RvMem.h"
+
+// Incremental snapshots of guest memory. Each capture only looks at the pages
+// RvMem reports dirty since the previous one, so its cost follows what the
+// guest wrote rather than what it has mapped. Pages written back to what the
+// last capture saw, or to zeros, are recognized and not copied again.
+class RvSnapshot {
+public:
+    using page_data = std::array<char, 1 << 12>;
+    enum page_kind_t : uint8_t {
+        // Contents follow in data
+        K_DATA,
+        // All zeros
+        K_ZERO,
+        // Unmapped since the previous capture
+        K_REMOVED,
+    };
+    struct page_t {
+        uint64_t addr;
+        int perm;
+        page_kind_t kind;
+        // Index into delta_t::data of K_DATA pages
+        size_t index;
+    };
+    // Pages that changed since the previous capture, in address order
+    struct delta_t {
+        std::vector<page_t> pages;
+        std::vector<page_data> data;
+    };
+    struct stat_t {
+        uint64_t captures;
+        // Reported dirty by RvMem, unchanged ones included
+        uint64_t dirty;
+        uint64_t zero;
+        uint64_t unchanged;
+        uint64_t copied;
+        uint64_t removed;
+    };
+private:
+    struct saved_t {
+        int perm;
+        // nullptr for a zero page
+        std::unique_ptr<page_data> data;
+    };
+    RvMem &mem;
+    // Contents as of the last capture
+    std::unordered_map<uint64_t, saved_t> current;
+    stat_t stat;
+public:
+    explicit RvSnapshot(RvMem &mem);
+    // Changes since the previous capture, the first one has all mapped pages
+    delta_t capture();
+    const stat_t &get_stat() const { return stat; }
+    // "RVSN", the page count, then each page as addr, perm, kind and the
+    // 4 KiB of K_DATA pages, all little endian
+    static void write(const delta_t &delta, std::ostream &out);
+    // The next delta write put in, false at the end or if it's malformed
+    static bool read(std::istream &in, delta_t &delta);
+};
@@ -6,7 +6,10 @@
 #include <vector>
 #include <optional>
 #include <memory>
+#include <chrono>
+#include <thread>
 #include <cstdint>
+#include <algorithm>
 
 #include "3rd/cxxopts.hpp"
 #include "3rd/elfio/elfio.hpp"
@@ -15,6 +18,11 @@
 #include "RvMem.h"
 #include "RvInst.h"
 #include "RvExcept.hpp"
+#include "RvCodeCache.h"
+#include "RvDecodeCache.h"
+#include "RvImage.h"
+#include "RvMemDump.h"
+#include "RvSnapshot.h"
 
 constexpr uint64_t PGSIZE = 1 << 12;
 constexpr uint64_t HALT_MAGIC = 0xdeadbeefdeadbeef;
@@ -25,10 +33,22 @@ int main(int argc, const char *argv[])
     options.add_options()
         ("R,run", "Instantly run and return (default)")
         ("O,output", "Output to a file, default to stdout(-)", cxxopts::value<std::string>()->default_value("-"))
-        ("M,memory", "Output to a file, default no file is generated", cxxopts::value<std::string>())
+        ("M,memory", "Write a sparse image of guest memory to a file when the run ends, default no file is generated", cxxopts::value<std::string>())
         ("B,address", "Set base address to ADDR(hex)", cxxopts::value<std::string>()->default_value("0"))
         ("I,interactive", "Interactive mode")
         ("A,arguments", "Arguments to be passed", cxxopts::value<std::string>()->default_value(""))
+        ("stack-size", "Stack limit in MiB, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("8"))
+        ("heap-size", "Heap limit in MiB after the loaded segments, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("64"))
+        ("E,engine", "Execution engine: simple (traces insts), threaded, jit or tiered", cxxopts::value<std::string>()->default_value("simple"))
+        ("block-threshold", "Entries of cold code before tiered builds a block", cxxopts::value<uint64_t>()->default_value(std::to_string(RvTieredCpu::BUILD_THRESHOLD)))
+        ("jit-threshold", "Entries of a block before jit or tiered translates it", cxxopts::value<uint64_t>()->default_value(std::to_string(RvJitCpu::HOT_THRESHOLD)))
+        ("code-cache", "Directory keeping decoded blocks across runs of threaded, jit or tiered", cxxopts::value<std::string>())
+        ("flat-memory", "Map guest memory below 4 GiB into one host region guarded by the host MMU")
+        ("predecode", "Decode all executable segments at load on every core instead of on first use")
+        ("map-elf", "Map segments from the file copy-on-write instead of copying them, only partial pages and bss are copied")
+        ("snapshot-every", "Snapshot memory written since the last snapshot every N instructions", cxxopts::value<uint64_t>())
+        ("snapshot-file", "Append the snapshots to a file", cxxopts::value<std::string>())
+        ("jit-threads", "Threads translating blocks for jit or tiered, 0 translates inline", cxxopts::value<size_t>()->default_value(std::to_string(RvJitCpu::JIT_THREADS)))
         ("h,help", "Display this content")
         ("FILE", "ELF file", cxxopts::value<std::string>())
     ;
@@ -44,8 +64,12 @@ int main(int argc, const char *argv[])
         return 0;
     }
     uint64_t addr_base = std::stoull(result["address"].as<std::string>(), 0, 16);
+    using ms = std::chrono::duration<double, std::milli>;
+    auto load_start{ std::chrono::steady_clock::now() };
     ELFIO::elfio reader;
-    if (!result.count("FILE") || !reader.load(result["FILE"].as<std::string>())) {
+    // Lazily, segment data is then only read if the file can't be mapped
+    bool map_elf{ result.count("map-elf") > 0 };
+    if (!result.count("FILE") || !reader.load(result["FILE"].as<std::string>(), map_elf)) {
         std::cerr << "No file specified or cannot open the file" << std::endl;
         std::cerr << options.help() << std::endl;
         return 1;
@@ -69,10 +93,23 @@ int main(int argc, const char *argv[])
         std::cerr << "Note: can only load static-link ELF files" << std::endl;
         return 1; 
     }
-    RvMem mem;
+    auto parsed{ std::chrono::steady_clock::now() };
+    RvMem mem(result.count("flat-memory"));
+    if (result.count("flat-memory") && !mem.is_flat())
+        std::cerr << "Cannot reserve flat memory, falling back to the page table" << std::endl;
+    std::vector<std::pair<uint64_t, uint64_t>> exec_ranges;
     std::vector<std::unique_ptr<char []>> mem_segs;
+    uint64_t image_end{};
+    std::shared_ptr<RvImage> elf_map;
+    if (map_elf) {
+        elf_map = RvImage::open(result["FILE"].as<std::string>());
+        if (!elf_map)
+            std::cerr << "Cannot map the file, copying segments instead" << std::endl;
+    }
     std::optional<std::pair<uint64_t, uint64_t>> main_addr{};
     uint64_t global_ptr{};
+    // Code cache key, over everything that ends up in guest memory
+    uint64_t image_hash{ RvCodeCache::hash(&addr_base, sizeof(addr_base)) };
     for (auto &segment : reader.segments) {
         if (segment->get_type() != ELFIO::PT_LOAD)
             continue;
@@ -89,12 +126,58 @@ int main(int argc, const char *argv[])
             perm |= mem.P_WRITE;
         if (segment->get_flags() & ELFIO::PF_X)
             perm |= mem.P_EXEC;
+        if (elf_map && segment->get_offset() + fsize > elf_map->length()) {
+            std::cerr << "Segment lies outside of the file" << std::endl;
+            return 1;
+        }
+        const char *seg_data{ elf_map ? elf_map->data() + segment->get_offset() : segment->get_data() };
+        for (uint64_t field : { segment->get_virtual_address(), msize, static_cast<uint64_t>(perm) })
+            image_hash = RvCodeCache::hash(&field, sizeof(field), image_hash);
+        image_hash = RvCodeCache::hash(seg_data, fsize, image_hash);
+        if (elf_map) {
+            auto file_start{ segment->get_virtual_address() + addr_base };
+            auto file_end{ file_start + fsize };
+            auto first{ file_start & ~(PGSIZE - 1) };
+            auto last{ (file_start + msize + PGSIZE - 1) & ~(PGSIZE - 1) };
+            // Pages wholly inside the file image are used in place
+            auto direct_start{ (file_start + PGSIZE - 1) & ~(PGSIZE - 1) };
+            auto direct_end{ std::max(direct_start, file_end & ~(PGSIZE - 1)) };
+            for (auto i{ direct_start }; i < direct_end; i += PGSIZE)
+                mem.map_cow_page(i, perm, elf_map->data() + segment->get_offset() + (i - file_start));
+            // The partial pages around them and bss are copied into zeroed pages
+            for (auto [start, end] : { std::pair{ first, direct_start }, std::pair{ direct_end, last } }) {
+                if (start >= end)
+                    continue;
+                std::unique_ptr<char []> copy{ new char[end - start]{} };
+                auto lo{ std::max(start, file_start) };
+                auto hi{ std::min(end, file_end) };
+                if (lo < hi)
+                    ::memcpy(&copy[lo - start], seg_data + (lo - file_start), hi - lo);
+                for (auto i{ start }; i < end; i += PGSIZE)
+                    mem.map_page(i, perm, &copy[i - start]);
+                mem_segs.push_back(std::move(copy));
+            }
+            if (perm & mem.P_EXEC)
+                exec_ranges.emplace_back(first, last);
+            image_end = std::max(image_end, last);
+            continue;
+        }
         std::unique_ptr<char []> seg_mem{new char[end_vaddr - start_vaddr]{}};
-        ::memcpy(&seg_mem[offset], segment->get_data(), fsize);
-        for (auto i{start_vaddr + addr_base}; i < end_vaddr + addr_base; i += PGSIZE) {
+        ::memcpy(&seg_mem[offset], seg_data, fsize);
+        for (auto i{start_vaddr + addr_base}; i < end_vaddr + addr_base;) {
+            // Whole 2 MiB spans take a single entry
+            if (i % mem.HUGE_SIZE == 0 && end_vaddr + addr_base - i >= mem.HUGE_SIZE) {
+                mem.map_huge_page(i, perm, &seg_mem[i - start_vaddr - addr_base]);
+                i += mem.HUGE_SIZE;
+                continue;
+            }
             mem.map_page(i, perm, &seg_mem[i - start_vaddr - addr_base]);
+            i += PGSIZE;
         }
         mem_segs.push_back(std::move(seg_mem));
+        image_end = std::max(image_end, end_vaddr + addr_base);
+        if (perm & mem.P_EXEC)
+            exec_ranges.emplace_back(start_vaddr + addr_base, end_vaddr + addr_base);
     }
     for (auto &section : reader.sections) {
         if (section->get_type() == ELFIO::SHT_SYMTAB) {
@@ -123,13 +206,14 @@ int main(int argc, const char *argv[])
         std::cerr << "Cannot find main symbol" << std::endl;
         return 1;
     }
-    // Create stack, allocate a page
-    std::unique_ptr<char[]> stack_ptr{ new char[PGSIZE] {} };
+    // Stack and heap grow as they're touched, up to their limits
     constexpr uint64_t STACK_LIMIT = 0x80000000;
     constexpr uint64_t ARG_BASE = 0xB0000000;
     constexpr uint64_t PARG_BASE = 0xA0000000;
-    mem.map_page(STACK_LIMIT - PGSIZE, mem.P_READ | mem.P_WRITE, stack_ptr.get());
-    mem_segs.push_back(std::move(stack_ptr));
+    auto stack_size{ std::clamp(result["stack-size"].as<uint64_t>() << 20, PGSIZE, STACK_LIMIT) };
+    mem.reserve(STACK_LIMIT - stack_size, STACK_LIMIT, mem.P_READ | mem.P_WRITE);
+    auto heap_base{ (image_end + PGSIZE - 1) & ~(PGSIZE - 1) };
+    mem.reserve(heap_base, heap_base + (result["heap-size"].as<uint64_t>() << 20), mem.P_READ | mem.P_WRITE);
     RvReg reg;
     reg.ra = HALT_MAGIC;
     reg.sp = STACK_LIMIT - 8;
@@ -163,8 +247,50 @@ int main(int argc, const char *argv[])
     reg.a1 = PARG_BASE;
     mem_segs.push_back(std::move(ptr_args));
     mem_segs.push_back(std::move(ptr_pargs));
-    RvSimpleCpu cpu(mem, reg);
+    auto mapped{ std::chrono::steady_clock::now() };
+    // Warm every slot up front, engines fall back to decoding lazily
+    std::shared_ptr<RvDecodeCache> icache;
+    size_t predecode_threads{};
+    size_t predecoded{};
+    if (result.count("predecode")) {
+        icache = std::make_shared<RvDecodeCache>(mem);
+        predecode_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        for (auto [start, end] : exec_ranges)
+            predecoded += icache->predecode(start, end, predecode_threads);
+    }
+    auto decoded{ std::chrono::steady_clock::now() };
+    std::unique_ptr<RvBaseCpu> cpu_ptr;
+    auto engine{ result["engine"].as<std::string>() };
+    if (engine == "simple")
+        cpu_ptr = std::make_unique<RvSimpleCpu>(mem, reg, icache);
+    else if (engine == "threaded")
+        cpu_ptr = std::make_unique<RvThreadedCpu>(mem, reg, icache);
+    else if (engine == "jit")
+        cpu_ptr = std::make_unique<RvJitCpu>(mem, reg, icache, result["jit-threshold"].as<uint64_t>(), result["jit-threads"].as<size_t>());
+    else if (engine == "tiered")
+        cpu_ptr = std::make_unique<RvTieredCpu>(mem, reg, result["block-threshold"].as<uint64_t>(), result["jit-threshold"].as<uint64_t>(), result["jit-threads"].as<size_t>(), icache);
+    else {
+        std::cerr << "Unknown engine " << engine << std::endl;
+        std::cerr << options.help() << std::endl;
+        return 1;
+    }
+    RvBaseCpu &cpu{ *cpu_ptr };
     cpu.add_breakpoint(HALT_MAGIC);
+    auto threaded{ dynamic_cast<RvThreadedCpu *>(&cpu) };
+    std::unique_ptr<RvCodeCache> code_cache;
+    if (threaded && result.count("code-cache")) {
+        code_cache = std::make_unique<RvCodeCache>(result["code-cache"].as<std::string>(), image_hash);
+        if (code_cache->load())
+            threaded->load_blocks(*code_cache);
+    }
+    auto save_code_cache{ [&] {
+        if (code_cache && !threaded->save_blocks(*code_cache))
+            std::cerr << "Cannot write code cache" << std::endl;
+    } };
+    auto dump_memory{ [&] {
+        if (result.count("memory") && !rv_mem_dump(mem, result["memory"].as<std::string>()))
+            std::cerr << "Cannot write memory image" << std::endl;
+    } };
     // Interactive section
     if (result.count("interactive")) {
         std::string command;
@@ -216,15 +342,20 @@ int main(int argc, const char *argv[])
                     std::cout << "Invalid arguments." << std::endl;
                     continue;
                 }
+                std::vector<uint8_t> data(len);
+                size_t valid{ len };
                 try {
-                    for (size_t i{}; i < len; i++, addr++) {
-                        uint8_t data{ static_cast<uint8_t>(cpu.mem[addr]) };
-                        std::cout << std::hex << static_cast<uint64_t>(data) << " ";
-                    }
+                    cpu.mem.read_block(addr, data.data(), len);
                 }
-                catch (const RvAccVio &) {
-                    std::cout << "Cannot access memory at 0x" << std::hex << addr;
+                catch (const RvAccVio &e) {
+                    // Show what's accessible before the fault
+                    valid = e.fault_addr() - addr;
+                    cpu.mem.read_block(addr, data.data(), valid);
                 }
+                for (size_t i{}; i < valid; i++)
+                    std::cout << std::hex << static_cast<uint64_t>(data[i]) << " ";
+                if (valid < len)
+                    std::cout << "Cannot access memory at 0x" << std::hex << addr + valid;
                 std::cout << std::endl;
             }
             else if (main_command == "b" || main_command == "break") {
@@ -253,8 +384,7 @@ int main(int argc, const char *argv[])
                     addr = cpu.reg.pc;
                 }
                 try {
-                    std::unique_ptr<RvInst> inst{ RvInst::decode(cpu.mem.fetch(addr)) };
-                    std::cout << inst->name() << std::endl;
+                    std::cout << RvDecodedInst::decode(cpu.mem.fetch(addr)).name() << std::endl;
                 }
                 catch (const RvAccVio &) {
                     std::cout << "Cannot access memory at 0x" << std::hex << addr << std::endl;
@@ -279,10 +409,72 @@ int main(int argc, const char *argv[])
                 std::cout << "Unknown command." << std::endl;
             }
         }
+        save_code_cache();
+        dump_memory();
         return 0;
     }
-    auto exec_result{ cpu.exec() };
+    uint64_t exec_result{};
+    std::optional<RvSnapshot> snapshot;
+    if (result.count("snapshot-every") && result["snapshot-every"].as<uint64_t>()) {
+        auto every{ result["snapshot-every"].as<uint64_t>() };
+        std::ofstream snapshot_file;
+        if (result.count("snapshot-file")) {
+            snapshot_file.open(result["snapshot-file"].as<std::string>(), std::ios::binary);
+            if (!snapshot_file) {
+                std::cerr << "Couldn't open snapshot file." << std::endl;
+                return 1;
+            }
+        }
+        snapshot.emplace(mem);
+        // Engines stop at the limit unless the guest halts first, tiered may run past it
+        uint64_t executed;
+        do {
+            executed = cpu.exec(every);
+            exec_result += executed;
+            auto delta{ snapshot->capture() };
+            if (snapshot_file.is_open())
+                RvSnapshot::write(delta, snapshot_file);
+        } while (executed >= every);
+    }
+    else
+        exec_result = cpu.exec();
+    save_code_cache();
+    dump_memory();
     std::cout << "Processor exit after executed " << std::dec << exec_result << " instructions." << std::endl;
+    if (snapshot) {
+        auto &snapshot_stat{ snapshot->get_stat() };
+        std::cout << "Snapshots: " << snapshot_stat.captures << " taken, " << snapshot_stat.dirty << " dirty pages, "
+            << snapshot_stat.copied << " copied, " << snapshot_stat.zero << " zero, " << snapshot_stat.unchanged << " unchanged, "
+            << snapshot_stat.removed << " removed" << std::endl;
+    }
+    std::cout << "Load: ELF " << ms(parsed - load_start).count() << " ms, mapping " << ms(mapped - parsed).count() << " ms, ";
+    if (result.count("predecode"))
+        std::cout << "pre-decode " << ms(decoded - mapped).count() << " ms (" << predecoded << " slots on " << predecode_threads << " threads)" << std::endl;
+    else
+        std::cout << "decode on first use" << std::endl;
+    constexpr const char *TLB_NAME[]{ "read", "write", "fetch" };
+    auto &tlb_stat{ mem.get_tlb_stat() };
+    std::cout << "TLB";
+    for (size_t i{ 0 }; i < tlb_stat.size(); i++)
+        std::cout << (i ? ", " : ": ") << TLB_NAME[i] << " " << tlb_stat[i].hit << " hits " << tlb_stat[i].miss << " misses";
+    std::cout << std::endl;
+    if (threaded) {
+        std::cout << std::dec << threaded->get_fused_count() << " of them run as fused pairs." << std::endl;
+        constexpr const char *TIER_NAME[]{ "interpreter", "blocks", "native" };
+        auto &tier_stat{ threaded->get_tier_stat() };
+        for (size_t i{ 0 }; i < tier_stat.size(); i++)
+            std::cout << "Tier " << TIER_NAME[i] << ": " << tier_stat[i].insts << " instructions in "
+                << std::chrono::duration<double, std::milli>(tier_stat[i].time).count() << " ms" << std::endl;
+    }
+    if (auto jit{ dynamic_cast<RvJitCpu *>(&cpu) }) {
+        using us = std::chrono::duration<double, std::micro>;
+        auto &jit_stat{ jit->get_jit_stat() };
+        auto done{ std::max<uint64_t>(jit_stat.installed + jit_stat.dropped, 1) };
+        std::cout << jit_stat.installed << " blocks translated, " << jit_stat.dropped << " dropped, "
+            << "latency avg " << us(jit_stat.total_latency).count() / done << " us max " << us(jit_stat.max_latency).count() << " us, "
+            << "compile avg " << us(jit_stat.total_compile).count() / done << " us, "
+            << "max queue depth " << jit_stat.max_depth << std::endl;
+    }
     std::cout << "Register status: " << std::endl;
     for (int i{0}; i < 32; i++) {
         std::cout << RVREGABINAME[i] << "=0x" << std::hex << static_cast<uint64_t>(cpu.reg[i]) << std::endl;
@@ -0,0 +1,368 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <optional>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+
+#include "3rd/cxxopts.hpp"
+#include "3rd/elfio/elfio.hpp"
+
+#include "RvMem.h"
+#include "RvInst.h"
+#include "RvCodeCache.h"
+
+// Translates a static RISC-V ELF into C++ for the RvAot runtime, see RvAot.h.
+// Functions are taken from the symbol table, blocks are recovered by a
+// linear sweep of each function, starting at every branch or jump target
+// and after every inst leaving a block.
+
+static bool ends_block(const RvDecodedInst &inst)
+{
+    return inst.is_branch() || inst.is_fault() || inst.op == RvOp::JAL || inst.op == RvOp::JALR || inst.op == RvOp::ECALL || inst.op == RvOp::FENCE_I;
+}
+
+static std::string hex(uint64_t value)
+{
+    char buffer[24];
+    std::snprintf(buffer, sizeof(buffer), "0x%llxull", static_cast<unsigned long long>(value));
+    return buffer;
+}
+
+static std::string op_name(const RvDecodedInst &inst)
+{
+    std::string name{ inst.inst_name() };
+    for (auto &ch : name)
+        ch = static_cast<char>(std::toupper(static_cast<unsigned char>(ch)));
+    return "RvOp::" + name;
+}
+
+static std::string reg(uint8_t id)
+{
+    return "c.x[" + std::to_string(id) + "]";
+}
+
+static std::string func_name(uint64_t pc)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "f_%llx", static_cast<unsigned long long>(pc));
+    return buffer;
+}
+
+static std::string label(uint64_t pc)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "b_%llx", static_cast<unsigned long long>(pc));
+    return buffer;
+}
+
+class RvAotWriter {
+    std::ostream &out;
+    const std::map<uint64_t, RvDecodedInst> &insts;
+    const std::set<uint64_t> &leaders;
+    // Function starts to their ends
+    const std::map<uint64_t, uint64_t> &funcs;
+    uint64_t start;
+    uint64_t end;
+    bool local(uint64_t target) const
+    {
+        return target >= start && target < end && leaders.contains(target);
+    }
+    // Leave for target, a goto if it's in this function
+    void jump(uint64_t target, const char *indent)
+    {
+        if (local(target))
+            out << indent << "goto " << label(target) << ";\n";
+        else
+            out << indent << "return " << hex(target) << ";\n";
+    }
+    void inst(uint64_t pc, const RvDecodedInst &inst);
+public:
+    RvAotWriter(std::ostream &out, const std::map<uint64_t, RvDecodedInst> &insts, const std::set<uint64_t> &leaders, const std::map<uint64_t, uint64_t> &funcs)
+        : out{ out }
+        , insts{ insts }
+        , leaders{ leaders }
+        , funcs{ funcs }
+        , start{}
+        , end{}
+    {
+        return;
+    }
+    // Write the function at start, appending its blocks
+    void func(uint64_t start, uint64_t end, std::vector<std::pair<uint64_t, uint64_t>> &blocks);
+};
+
+void RvAotWriter::inst(uint64_t pc, const RvDecodedInst &inst)
+{
+    constexpr const char *LOAD_TYPE[]{ "int8_t", "int16_t", "int32_t", "uint64_t", "uint8_t", "uint16_t", "uint32_t" };
+    constexpr const char *STORE_TYPE[]{ "uint8_t", "uint16_t", "uint32_t", "uint64_t" };
+    auto op{ inst.op };
+    auto imm{ std::to_string(inst.imm) + "ll" };
+    out << "    // " << std::hex << pc << std::dec << ": " << inst.name() << "\n";
+    if (op <= RvOp::REMW) {
+        if (inst.rd)
+            out << "    " << reg(inst.rd) << " = rv_r<" << op_name(inst) << ">(" << reg(inst.rs1) << ", " << reg(inst.rs2) << ");\n";
+    }
+    else if (op <= RvOp::SRAIW) {
+        if (inst.rd)
+            out << "    " << reg(inst.rd) << " = rv_i<" << op_name(inst) << ">(" << reg(inst.rs1) << ", " << imm << ");\n";
+    }
+    else if (op <= RvOp::LWU) {
+        // Loads to x0 still fault
+        auto type{ LOAD_TYPE[static_cast<size_t>(op) - static_cast<size_t>(RvOp::LB)] };
+        out << "    c.pc = " << hex(pc) << ";\n    ";
+        if (inst.rd)
+            out << reg(inst.rd) << " = ";
+        out << "rv_load<" << type << ">(c.mem, " << reg(inst.rs1) << " + " << imm << ");\n";
+    }
+    else if (op <= RvOp::SD) {
+        auto type{ STORE_TYPE[static_cast<size_t>(op) - static_cast<size_t>(RvOp::SB)] };
+        out << "    c.pc = " << hex(pc) << ";\n";
+        out << "    rv_store<" << type << ">(c.mem, " << reg(inst.rs1) << " + " << imm << ", " << reg(inst.rs2) << ");\n";
+    }
+    else if (op <= RvOp::BGEU) {
+        out << "    if (rv_b<" << op_name(inst) << ">(" << reg(inst.rs1) << ", " << reg(inst.rs2) << "))\n";
+        jump(inst.get_target(pc), "        ");
+    }
+    else if (op == RvOp::JALR) {
+        // rd may be rs1
+        out << "    pc = " << reg(inst.rs1) << " + " << imm << ";\n";
+        if (inst.rd) {
+            out << "    " << reg(inst.rd) << " = " << hex(pc + 4) << ";\n";
+            out << "    if (auto callee{ rv_aot_find(pc) }; callee && c.depth < RV_AOT_MAX_DEPTH) {\n";
+            out << "        c.depth++;\n";
+            out << "        pc = callee->func(c, pc);\n";
+            out << "        c.depth--;\n";
+            out << "    }\n";
+        }
+        out << "    goto local;\n";
+    }
+    else if (op == RvOp::ECALL)
+        out << "    rv_aot_syscall(c, " << hex(pc + 4) << ");\n";
+    else if (op == RvOp::FENCE_I)
+        // rv_aot_run checks for modified code before going on
+        out << "    return " << hex(pc + 4) << ";\n";
+    else if (op == RvOp::AUIPC) {
+        if (inst.rd)
+            out << "    " << reg(inst.rd) << " = " << hex(pc + inst.imm) << ";\n";
+    }
+    else if (op == RvOp::LUI) {
+        if (inst.rd)
+            out << "    " << reg(inst.rd) << " = " << hex(inst.imm) << ";\n";
+    }
+    else if (op == RvOp::JAL) {
+        auto target{ pc + inst.imm };
+        if (inst.rd)
+            out << "    " << reg(inst.rd) << " = " << hex(pc + 4) << ";\n";
+        if (inst.rd && funcs.contains(target)) {
+            out << "    if (c.depth < RV_AOT_MAX_DEPTH) {\n";
+            out << "        c.depth++;\n";
+            out << "        pc = " << func_name(target) << "(c, " << hex(target) << ");\n";
+            out << "        c.depth--;\n";
+            out << "        goto local;\n";
+            out << "    }\n";
+            out << "    return " << hex(target) << ";\n";
+        }
+        else
+            jump(target, "    ");
+    }
+    else {
+        out << "    c.pc = " << hex(pc) << ";\n";
+        out << "    throw RvIllIns(" << hex(pc) << ");\n";
+    }
+}
+
+void RvAotWriter::func(uint64_t start, uint64_t end, std::vector<std::pair<uint64_t, uint64_t>> &blocks)
+{
+    this->start = start;
+    this->end = end;
+    auto first{ leaders.lower_bound(start) };
+    auto last{ leaders.lower_bound(end) };
+    out << "static uint64_t " << func_name(start) << "(RvAotContext &c, uint64_t pc)\n{\n";
+    out << "local:\n    switch (pc) {\n";
+    for (auto it{ first }; it != last; ++it)
+        out << "    case " << hex(*it) << ": goto " << label(*it) << ";\n";
+    out << "    default: return pc;\n    }\n";
+    for (auto it{ first }; it != last; ++it) {
+        auto block_start{ *it };
+        auto block_end{ std::next(it) == last ? end : *std::next(it) };
+        out << label(block_start) << ":\n";
+        out << "    c.count += " << (block_end - block_start) / 4 << ";\n";
+        blocks.emplace_back(block_start, (block_end - block_start) / 4);
+        for (auto pc{ block_start }; pc < block_end; pc += 4)
+            inst(pc, insts.at(pc));
+    }
+    // Fell off the end
+    out << "    return " << hex(end) << ";\n}\n\n";
+}
+
+int main(int argc, const char *argv[])
+{
+    cxxopts::Options options(argv[0], "Translate a Risc-V ELF into C++ for the RvAot runtime");
+    options.add_options()
+        ("o,output", "Output to a file, default to stdout(-)", cxxopts::value<std::string>()->default_value("-"))
+        ("B,address", "Set base address to ADDR(hex), must match the runtime's", cxxopts::value<std::string>()->default_value("0"))
+        ("h,help", "Display this content")
+        ("FILE", "ELF file", cxxopts::value<std::string>())
+    ;
+    options.parse_positional({"FILE"});
+    auto result{ options.parse(argc, argv) };
+    if (result.count("help")) {
+        std::cerr << options.help() << std::endl;
+        return 0;
+    }
+    uint64_t addr_base = std::stoull(result["address"].as<std::string>(), 0, 16);
+    ELFIO::elfio reader;
+    if (!result.count("FILE") || !reader.load(result["FILE"].as<std::string>())) {
+        std::cerr << "No file specified or cannot open the file" << std::endl;
+        std::cerr << options.help() << std::endl;
+        return 1;
+    }
+    if (reader.get_class() != ELFIO::ELFCLASS64) {
+        std::cerr << "ELF class error" << std::endl;
+        return 1;
+    }
+    if (reader.get_encoding() != ELFIO::ELFDATA2LSB) {
+        std::cerr << "ELF encoding error" << std::endl;
+        return 1;
+    }
+    if (reader.get_machine() != ELFIO::EM_RISCV) {
+        std::cerr << "ELF architecture error" << std::endl;
+        std::cerr << "Expect Risc-V, found " << reader.get_machine() << std::endl;
+        return 1;
+    }
+    if (reader.get_type() != ELFIO::ET_EXEC) {
+        std::cerr << "ELF type error" << std::endl;
+        std::cerr << "Expect EXEC, found " << reader.get_type() << std::endl;
+        std::cerr << "Note: can only load static-link ELF files" << std::endl;
+        return 1;
+    }
+    // Same hash as RvSimpleEmul keys its code cache with, checked by the runtime
+    uint64_t image_hash{ RvCodeCache::hash(&addr_base, sizeof(addr_base)) };
+    std::map<uint64_t, RvDecodedInst> insts;
+    // Executable ranges
+    std::map<uint64_t, uint64_t> exec_segs;
+    for (auto &segment : reader.segments) {
+        if (segment->get_type() != ELFIO::PT_LOAD)
+            continue;
+        auto fsize{ segment->get_file_size() };
+        auto msize{ segment->get_memory_size() };
+        int perm{};
+        if (segment->get_flags() & ELFIO::PF_R)
+            perm |= RvMem::P_READ;
+        if (segment->get_flags() & ELFIO::PF_W)
+            perm |= RvMem::P_WRITE;
+        if (segment->get_flags() & ELFIO::PF_X)
+            perm |= RvMem::P_EXEC;
+        for (uint64_t field : { segment->get_virtual_address(), msize, static_cast<uint64_t>(perm) })
+            image_hash = RvCodeCache::hash(&field, sizeof(field), image_hash);
+        image_hash = RvCodeCache::hash(segment->get_data(), fsize, image_hash);
+        if (!(perm & RvMem::P_EXEC))
+            continue;
+        auto start{ (segment->get_virtual_address() + 3) & ~3ull };
+        auto end{ (segment->get_virtual_address() + fsize) & ~3ull };
+        for (auto pc{ start }; pc < end; pc += 4) {
+            uint32_t raw;
+            ::memcpy(&raw, segment->get_data() + (pc - segment->get_virtual_address()), sizeof(raw));
+            insts.emplace(pc + addr_base, RvDecodedInst::decode(raw));
+        }
+        if (start < end)
+            exec_segs[start + addr_base] = end + addr_base;
+    }
+    // Function entries to their sizes, each one runs up to its size if known,
+    // otherwise up to the next one or the end of its segment
+    std::map<uint64_t, uint64_t> entries;
+    std::optional<uint64_t> main_addr{};
+    for (auto &section : reader.sections) {
+        if (section->get_type() == ELFIO::SHT_SYMTAB) {
+            const ELFIO::symbol_section_accessor symbols(reader, section.get());
+            for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+                std::string name;
+                ELFIO::Elf64_Addr addr;
+                ELFIO::Elf_Xword size;
+                unsigned char bind;
+                unsigned char type;
+                ELFIO::Elf_Half sec_index;
+                unsigned char other;
+                symbols.get_symbol(i, name, addr, size, bind, type, sec_index, other);
+                if (name == "main")
+                    main_addr = addr;
+                if (type == ELFIO::STT_FUNC || name == "main")
+                    entries[addr + addr_base] = std::max<uint64_t>(entries[addr + addr_base], size);
+            }
+        }
+    }
+    if (!main_addr) {
+        std::cerr << "Cannot find main symbol" << std::endl;
+        return 1;
+    }
+    entries.try_emplace(reader.get_entry() + addr_base, 0);
+    std::map<uint64_t, uint64_t> funcs;
+    for (auto it{ entries.begin() }; it != entries.end(); ++it) {
+        auto [start, size] { *it };
+        auto seg{ exec_segs.upper_bound(start) };
+        if ((start & 3) || seg == exec_segs.begin() || start >= (--seg)->second)
+            continue;
+        auto next{ std::next(it) };
+        auto end{ next == entries.end() ? seg->second : std::min(next->first, seg->second) };
+        if (size)
+            end = std::min<uint64_t>(end, (start + size + 3) & ~3ull);
+        funcs[start] = end;
+    }
+    // Block leaders over the whole image, so jumps between functions land on blocks too
+    std::set<uint64_t> leaders;
+    for (auto &[start, end] : funcs)
+        leaders.insert(start);
+    for (auto &[pc, inst] : insts) {
+        if (!ends_block(inst))
+            continue;
+        leaders.insert(pc + 4);
+        if (inst.is_branch())
+            leaders.insert(inst.get_target(pc));
+        else if (inst.op == RvOp::JAL)
+            leaders.insert(pc + inst.imm);
+    }
+    // Only leaders inside functions, block ends are read off the next one
+    std::erase_if(leaders, [&](uint64_t pc) {
+        auto func{ funcs.upper_bound(pc) };
+        return (pc & 3) || func == funcs.begin() || pc >= (--func)->second;
+    });
+    std::ofstream fout;
+    auto &&output{ result["output"].as<std::string>() };
+    if (output != "-") {
+        fout.open(output);
+        if (!fout) {
+            std::cerr << "Cannot open " << output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out{ output == "-" ? std::cout : fout };
+    out << "// Generated by RvAotTranslate from " << result["FILE"].as<std::string>() << ", do not edit\n";
+    out << "#include \"RvAot.h\"\n\n";
+    for (auto &[start, end] : funcs)
+        out << "static uint64_t " << func_name(start) << "(RvAotContext &c, uint64_t pc);\n";
+    out << "\n";
+    RvAotWriter writer(out, insts, leaders, funcs);
+    std::vector<std::pair<uint64_t, uint64_t>> blocks;
+    for (auto &[start, end] : funcs)
+        writer.func(start, end, blocks);
+    out << "extern const uint64_t rv_aot_image_hash{ " << hex(image_hash) << " };\n";
+    out << "extern const RvAotBlock rv_aot_blocks[]{\n";
+    for (auto &[start, length] : blocks) {
+        auto func{ std::prev(funcs.upper_bound(start)) };
+        out << "    { " << hex(start) << ", " << length << ", " << func_name(func->first) << " },\n";
+    }
+    out << "};\n";
+    out << "extern const size_t rv_aot_block_count{ " << blocks.size() << " };\n";
+    if (!out.flush()) {
+        std::cerr << "Cannot write " << output << std::endl;
+        return 1;
+    }
+    std::cerr << "Translated " << funcs.size() << " functions, " << blocks.size() << " blocks" << std::endl;
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "3rd/cxxopts.hpp"
+#include "3rd/elfio/elfio.hpp"
+
+#include "RvAot.h"
+#include "RvCpu.h"
+#include "RvMem.h"
+#include "RvExcept.hpp"
+#include "RvCodeCache.h"
+
+constexpr uint64_t PGSIZE = 1 << 12;
+constexpr uint64_t HALT_MAGIC = 0xdeadbeefdeadbeef;
+
+int main(int argc, const char *argv[])
+{
+    cxxopts::Options options(argv[0], "Risc-V program translated by RvAotTranslate");
+    options.add_options()
+        ("R,run", "Instantly run and return (default)")
+        ("B,address", "Set base address to ADDR(hex), must match the translation's", cxxopts::value<std::string>()->default_value("0"))
+        ("A,arguments", "Arguments to be passed", cxxopts::value<std::string>()->default_value(""))
+        ("stack-size", "Stack limit in MiB, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("8"))
+        ("heap-size", "Heap limit in MiB after the loaded segments, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("64"))
+        ("h,help", "Display this content")
+        ("FILE", "ELF file", cxxopts::value<std::string>())
+    ;
+    options.parse_positional({"FILE"});
+    auto result{ options.parse(argc, argv) };
+    if (result.count("help")) {
+        std::cerr << options.help() << std::endl;
+        return 0;
+    }
+    uint64_t addr_base = std::stoull(result["address"].as<std::string>(), 0, 16);
+    ELFIO::elfio reader;
+    if (!result.count("FILE") || !reader.load(result["FILE"].as<std::string>())) {
+        std::cerr << "No file specified or cannot open the file" << std::endl;
+        std::cerr << options.help() << std::endl;
+        return 1;
+    }
+    if (reader.get_class() != ELFIO::ELFCLASS64) {
+        std::cerr << "ELF class error" << std::endl;
+        return 1;
+    }
+    if (reader.get_encoding() != ELFIO::ELFDATA2LSB) {
+        std::cerr << "ELF encoding error" << std::endl;
+        return 1;
+    }
+    if (reader.get_machine() != ELFIO::EM_RISCV) {
+        std::cerr << "ELF architecture error" << std::endl;
+        std::cerr << "Expect Risc-V, found " << reader.get_machine() << std::endl;
+        return 1;
+    }
+    if (reader.get_type() != ELFIO::ET_EXEC) {
+        std::cerr << "ELF type error" << std::endl;
+        std::cerr << "Expect EXEC, found " << reader.get_type() << std::endl;
+        std::cerr << "Note: can only load static-link ELF files" << std::endl;
+        return 1; 
+    }
+    RvMem mem;
+    std::vector<std::unique_ptr<char []>> mem_segs;
+    uint64_t image_end{};
+    std::optional<std::pair<uint64_t, uint64_t>> main_addr{};
+    uint64_t global_ptr{};
+    // Same hash as the translation was made for
+    uint64_t image_hash{ RvCodeCache::hash(&addr_base, sizeof(addr_base)) };
+    for (auto &segment : reader.segments) {
+        if (segment->get_type() != ELFIO::PT_LOAD)
+            continue;
+        auto fsize{segment->get_file_size()};
+        auto msize{segment->get_memory_size()};
+        auto align{segment->get_align()};
+        auto start_vaddr{segment->get_virtual_address() & ~(align - 1)};
+        auto end_vaddr{(segment->get_virtual_address() + msize + align - 1) & ~(align - 1)};
+        auto offset{segment->get_virtual_address() - start_vaddr};
+        int perm{};
+        if (segment->get_flags() & ELFIO::PF_R)
+            perm |= mem.P_READ;
+        if (segment->get_flags() & ELFIO::PF_W)
+            perm |= mem.P_WRITE;
+        if (segment->get_flags() & ELFIO::PF_X)
+            perm |= mem.P_EXEC;
+        std::unique_ptr<char []> seg_mem{new char[end_vaddr - start_vaddr]{}};
+        ::memcpy(&seg_mem[offset], segment->get_data(), fsize);
+        for (uint64_t field : { segment->get_virtual_address(), msize, static_cast<uint64_t>(perm) })
+            image_hash = RvCodeCache::hash(&field, sizeof(field), image_hash);
+        image_hash = RvCodeCache::hash(segment->get_data(), fsize, image_hash);
+        for (auto i{start_vaddr + addr_base}; i < end_vaddr + addr_base;) {
+            // Whole 2 MiB spans take a single entry
+            if (i % mem.HUGE_SIZE == 0 && end_vaddr + addr_base - i >= mem.HUGE_SIZE) {
+                mem.map_huge_page(i, perm, &seg_mem[i - start_vaddr - addr_base]);
+                i += mem.HUGE_SIZE;
+                continue;
+            }
+            mem.map_page(i, perm, &seg_mem[i - start_vaddr - addr_base]);
+            i += PGSIZE;
+        }
+        mem_segs.push_back(std::move(seg_mem));
+        image_end = std::max(image_end, end_vaddr + addr_base);
+    }
+    for (auto &section : reader.sections) {
+        if (section->get_type() == ELFIO::SHT_SYMTAB) {
+            const ELFIO::symbol_section_accessor symbols(reader, section.get());
+            for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); i++) {
+                std::string name;
+                ELFIO::Elf64_Addr addr;
+                ELFIO::Elf_Xword size;
+                unsigned char bind;
+                unsigned char type;
+                ELFIO::Elf_Half sec_index;
+                unsigned char other;
+                symbols.get_symbol(i, name, addr, size, bind, type, sec_index, other);
+                // Get main location
+                if (name == "main") {
+                    main_addr = {addr, size};
+                }
+                // Get gp register value
+                if (name == "__global_pointer$" || name == "_gp") {
+                    global_ptr = addr;
+                }
+            }
+        }
+    }
+    if (!main_addr) {
+        std::cerr << "Cannot find main symbol" << std::endl;
+        return 1;
+    }
+    // Stack and heap grow as they're touched, up to their limits
+    constexpr uint64_t STACK_LIMIT = 0x80000000;
+    constexpr uint64_t ARG_BASE = 0xB0000000;
+    constexpr uint64_t PARG_BASE = 0xA0000000;
+    auto stack_size{ std::clamp(result["stack-size"].as<uint64_t>() << 20, PGSIZE, STACK_LIMIT) };
+    mem.reserve(STACK_LIMIT - stack_size, STACK_LIMIT, mem.P_READ | mem.P_WRITE);
+    auto heap_base{ (image_end + PGSIZE - 1) & ~(PGSIZE - 1) };
+    mem.reserve(heap_base, heap_base + (result["heap-size"].as<uint64_t>() << 20), mem.P_READ | mem.P_WRITE);
+    RvReg reg;
+    reg.ra = HALT_MAGIC;
+    reg.sp = STACK_LIMIT - 8;
+    reg.pc = main_addr.value().first + addr_base;
+    reg.gp = global_ptr;
+    // Pass arguments
+    auto &&pargs_r{ result["arguments"].as<std::string>() };
+    std::vector<std::string> pargs{ result["FILE"].as<std::string>() };
+    std::vector<uint64_t> ppargs;
+    ppargs.push_back(ARG_BASE);
+    std::stringstream psin(pargs_r);
+    std::string parg;
+    size_t arg_size{ pargs[0].length() + 1 };
+    while (psin >> parg) {
+        ppargs.push_back(ARG_BASE + arg_size);
+        arg_size += parg.length() + 1;
+        pargs.push_back(parg);
+    }
+    arg_size = (arg_size + PGSIZE - 1) & ~(PGSIZE - 1);
+    auto pargc{ ppargs.size() };
+    std::unique_ptr<char[]> ptr_args{ new char[arg_size] {} };
+    for (size_t i{ 0 }; i < pargs.size(); i++)
+        ::memcpy(ptr_args.get() + ppargs[i] - ARG_BASE, pargs[i].c_str(), pargs[i].length() + 1);
+    for (auto i{ ARG_BASE }; i < ARG_BASE + arg_size; i += PGSIZE) {
+        mem.map_page(i, mem.P_READ, &ptr_args[i - ARG_BASE]);
+    }
+    std::unique_ptr<char[]> ptr_pargs{ new char[PGSIZE] {} };
+    ::memcpy(ptr_pargs.get(), ppargs.data(), ppargs.size() * sizeof(uint64_t));
+    mem.map_page(PARG_BASE, mem.P_READ, ptr_pargs.get());
+    reg.a0 = pargc;
+    reg.a1 = PARG_BASE;
+    mem_segs.push_back(std::move(ptr_args));
+    mem_segs.push_back(std::move(ptr_pargs));
+    if (image_hash != rv_aot_image_hash) {
+        std::cerr << "The program was translated from another image or base address" << std::endl;
+        return 1;
+    }
+    auto exec_result{ rv_aot_run(mem, reg, HALT_MAGIC) };
+    std::cout << "Processor exit after executed " << std::dec << exec_result << " instructions." << std::endl;
+    std::cout << "Register status: " << std::endl;
+    for (int i{0}; i < 32; i++) {
+        std::cout << RVREGABINAME[i] << "=0x" << std::hex << static_cast<uint64_t>(reg[i]) << std::endl;
+    }
+    std::cout << "pc=0x" << std::hex << reg.pc << std::endl;
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "3rd/cxxopts.hpp"
+
+#include "RvMemDump.h"
+#include "RvSnapshot.h"
+
+// Reads memory images written by -M, and checks snapshots written by
+// --snapshot-file against them
+int main(int argc, const char *argv[])
+{
+    cxxopts::Options options(argv[0], "Inspect a memory image written by RvSimpleEmul -M");
+    options.add_options()
+        ("x,examine", "Print the bytes at ADDR(hex) like the examine command of -I", cxxopts::value<std::string>())
+        ("length", "Bytes --examine prints", cxxopts::value<uint64_t>()->default_value("16"))
+        ("replay", "Replay the snapshots in a file and compare the result with the image", cxxopts::value<std::string>())
+        ("h,help", "Display this content")
+        ("FILE", "Memory image", cxxopts::value<std::string>())
+    ;
+    options.parse_positional({"FILE"});
+    auto result{ options.parse(argc, argv) };
+    if (result.count("help") || !result.count("FILE")) {
+        std::cerr << options.help() << std::endl;
+        return !result.count("help");
+    }
+    // Pages of the image, zero pages have no data
+    struct page_t {
+        int perm;
+        std::vector<char> data;
+    };
+    std::map<uint64_t, page_t> image;
+    auto loaded{ rv_mem_undump(result["FILE"].as<std::string>(), [&](uint64_t addr, int perm, const char *page) {
+        auto &entry{ image[addr] };
+        entry.perm = perm;
+        for (size_t i{ 0 }; i < 1 << 12; i++)
+            if (page[i]) {
+                entry.data.assign(page, page + (1 << 12));
+                break;
+            }
+    }) };
+    if (!loaded) {
+        std::cerr << "Cannot read memory image" << std::endl;
+        return 1;
+    }
+    std::cout << std::dec << image.size() << " pages" << std::endl;
+    if (result.count("examine")) {
+        uint64_t addr{ std::stoull(result["examine"].as<std::string>(), 0, 16) };
+        auto len{ result["length"].as<uint64_t>() };
+        for (uint64_t i{ 0 }; i < len; i++) {
+            auto it{ image.find((addr + i) & ~0xfffull) };
+            if (it == image.end()) {
+                std::cout << "Cannot access memory at 0x" << std::hex << addr + i;
+                break;
+            }
+            auto &data{ it->second.data };
+            std::cout << std::hex << static_cast<uint64_t>(data.empty() ? 0 : static_cast<uint8_t>(data[(addr + i) & 0xfff])) << " ";
+        }
+        std::cout << std::endl;
+    }
+    if (!result.count("replay"))
+        return 0;
+    std::ifstream in(result["replay"].as<std::string>(), std::ios::binary);
+    if (!in) {
+        std::cerr << "Cannot open snapshot file" << std::endl;
+        return 1;
+    }
+    std::map<uint64_t, page_t> replayed;
+    RvSnapshot::delta_t delta;
+    size_t deltas{};
+    while (RvSnapshot::read(in, delta)) {
+        deltas++;
+        for (auto &page : delta.pages) {
+            if (page.kind == RvSnapshot::K_REMOVED) {
+                replayed.erase(page.addr);
+                continue;
+            }
+            auto &entry{ replayed[page.addr] };
+            entry.perm = page.perm;
+            entry.data.clear();
+            if (page.kind == RvSnapshot::K_DATA)
+                entry.data.assign(delta.data[page.index].begin(), delta.data[page.index].end());
+        }
+    }
+    if (!in.eof()) {
+        std::cerr << "Malformed snapshot after " << deltas << " snapshots" << std::endl;
+        return 1;
+    }
+    for (auto &[addr, page] : image) {
+        auto it{ replayed.find(addr) };
+        // Zero pages compare equal however they were stored
+        auto zero{ [](const page_t &page) { return page.data.empty() || std::all_of(page.data.begin(), page.data.end(), [](char c) { return !c; }); } };
+        if (it == replayed.end() || it->second.perm != page.perm
+            || (zero(page) ? !zero(it->second) : it->second.data != page.data)) {
+            std::cout << "Snapshots differ from the image at 0x" << std::hex << addr << std::endl;
+            return 1;
+        }
+    }
+    if (replayed.size() != image.size()) {
+        std::cout << "Snapshots have pages the image doesn't" << std::endl;
+        return 1;
+    }
+    std::cout << deltas << " snapshots replayed, all pages match" << std::endl;
+    return 0;
+}
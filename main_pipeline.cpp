@@ -7,6 +7,7 @@
 #include <vector>
 #include <optional>
 #include <memory>
+#include <algorithm>
 #include <cstdint>
 
 #include "3rd/cxxopts.hpp"
@@ -16,6 +17,7 @@
 #include "RvMem.h"
 #include "RvInst.h"
 #include "RvExcept.hpp"
+#include "RvMemDump.h"
 
 constexpr uint64_t PGSIZE = 1 << 12;
 constexpr uint64_t HALT_MAGIC = 0xdeadbeefdeadbeef;
@@ -26,10 +28,12 @@ int main(int argc, const char *argv[])
     options.add_options()
         ("R,run", "Instantly run and return (default)")
         ("O,output", "Output to a file, default to stdout(-)", cxxopts::value<std::string>()->default_value("-"))
-        ("M,memory", "Output to a file, default no file is generated", cxxopts::value<std::string>())
+        ("M,memory", "Write a sparse image of guest memory to a file when the run ends, default no file is generated", cxxopts::value<std::string>())
         ("B,address", "Set base address to ADDR(hex)", cxxopts::value<std::string>()->default_value("0"))
         ("I,interactive", "Interactive mode")
         ("A,arguments", "Arguments to be passed", cxxopts::value<std::string>()->default_value(""))
+        ("stack-size", "Stack limit in MiB, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("8"))
+        ("heap-size", "Heap limit in MiB after the loaded segments, pages are mapped on first touch", cxxopts::value<uint64_t>()->default_value("64"))
         ("h,help", "Display this content")
         ("FILE", "ELF file", cxxopts::value<std::string>())
     ;
@@ -72,6 +76,7 @@ int main(int argc, const char *argv[])
     }
     RvMem mem;
     std::vector<std::unique_ptr<char []>> mem_segs;
+    uint64_t image_end{};
     std::optional<std::pair<uint64_t, uint64_t>> main_addr{};
     uint64_t global_ptr{};
     for (auto &segment : reader.segments) {
@@ -96,6 +101,7 @@ int main(int argc, const char *argv[])
             mem.map_page(i, perm, &seg_mem[i - start_vaddr - addr_base]);
         }
         mem_segs.push_back(std::move(seg_mem));
+        image_end = std::max(image_end, end_vaddr + addr_base);
     }
     for (auto &section : reader.sections) {
         if (section->get_type() == ELFIO::SHT_SYMTAB) {
@@ -124,13 +130,14 @@ int main(int argc, const char *argv[])
         std::cerr << "Cannot find main symbol" << std::endl;
         return 1;
     }
-    // Create stack, allocate a page
-    std::unique_ptr<char[]> stack_ptr{ new char[PGSIZE] {} };
+    // Stack and heap grow as they're touched, up to their limits
     constexpr uint64_t STACK_LIMIT = 0x80000000;
     constexpr uint64_t ARG_BASE = 0xB0000000;
     constexpr uint64_t PARG_BASE = 0xA0000000;
-    mem.map_page(STACK_LIMIT - PGSIZE, mem.P_READ | mem.P_WRITE, stack_ptr.get());
-    mem_segs.push_back(std::move(stack_ptr));
+    auto stack_size{ std::clamp(result["stack-size"].as<uint64_t>() << 20, PGSIZE, STACK_LIMIT) };
+    mem.reserve(STACK_LIMIT - stack_size, STACK_LIMIT, mem.P_READ | mem.P_WRITE);
+    auto heap_base{ (image_end + PGSIZE - 1) & ~(PGSIZE - 1) };
+    mem.reserve(heap_base, heap_base + (result["heap-size"].as<uint64_t>() << 20), mem.P_READ | mem.P_WRITE);
     RvReg reg;
     reg.ra = HALT_MAGIC;
     reg.sp = STACK_LIMIT - 8;
@@ -166,6 +173,10 @@ int main(int argc, const char *argv[])
     mem_segs.push_back(std::move(ptr_pargs));
     RvPipelineCpu cpu(mem, reg, std::make_shared<RvStaticBranchPred<false>>());
     cpu.add_breakpoint(HALT_MAGIC);
+    auto dump_memory{ [&] {
+        if (result.count("memory") && !rv_mem_dump(mem, result["memory"].as<std::string>()))
+            std::cerr << "Cannot write memory image" << std::endl;
+    } };
     // Interactive section
     if (result.count("interactive")) {
         std::string command;
@@ -244,15 +255,20 @@ int main(int argc, const char *argv[])
                     std::cout << "Invalid arguments." << std::endl;
                     continue;
                 }
+                std::vector<uint8_t> data(len);
+                size_t valid{ len };
                 try {
-                    for (size_t i{}; i < len; i++, addr++) {
-                        uint8_t data{ static_cast<uint8_t>(cpu.mem[addr]) };
-                        std::cout << std::hex << static_cast<uint64_t>(data) << " ";
-                    }
+                    cpu.mem.read_block(addr, data.data(), len);
                 }
-                catch (const RvAccVio &) {
-                    std::cout << "Cannot access memory at 0x" << std::hex << addr;
+                catch (const RvAccVio &e) {
+                    // Show what's accessible before the fault
+                    valid = e.fault_addr() - addr;
+                    cpu.mem.read_block(addr, data.data(), valid);
                 }
+                for (size_t i{}; i < valid; i++)
+                    std::cout << std::hex << static_cast<uint64_t>(data[i]) << " ";
+                if (valid < len)
+                    std::cout << "Cannot access memory at 0x" << std::hex << addr + valid;
                 std::cout << std::endl;
             }
             else if (main_command == "b" || main_command == "break") {
@@ -281,8 +297,7 @@ int main(int argc, const char *argv[])
                     addr = cpu.reg.pc;
                 }
                 try {
-                    std::unique_ptr<RvInst> inst{ RvInst::decode(cpu.mem.fetch(addr)) };
-                    std::cout << inst->name() << std::endl;
+                    std::cout << RvDecodedInst::decode(cpu.mem.fetch(addr)).name() << std::endl;
                 }
                 catch (const RvAccVio &) {
                     std::cout << "Cannot access memory at 0x" << std::hex << addr << std::endl;
@@ -307,9 +322,11 @@ int main(int argc, const char *argv[])
                 std::cout << "Unknown command." << std::endl;
             }
         }
+        dump_memory();
         return 0;
     }
     auto exec_result{ cpu.exec() };
+    dump_memory();
     std::cout << "Processor exit after executed " << std::dec << exec_result << " instructions." << std::endl;
     std::cout << "Register status: " << std::endl;
     for (int i{0}; i < 32; i++) {